@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "async_primitives.hpp"
+#include "buffer.hpp"
+#include "task.hpp"
+
+namespace sheep {
+
+
+/// what an acceptor does while the server is over budget
+enum class overload_action
+{
+    // cancel the accept, connections wait in the kernel backlog (and are
+    // refused by the kernel once it is full) until a connection closes
+    Pause,
+    // keep accepting and close what can't be admitted right away
+    Shed
+};
+
+/// zero means unlimited
+struct admission_limits
+{
+    std::size_t max_connections{0};
+    std::size_t max_connections_per_worker{0};
+    // bytes held by connection buffers across the server: the read and write
+    // Buffers and the segments of the input and output queues
+    std::size_t max_buffer_bytes{0};
+    // buffer memory a new connection is expected to need, it is only admitted
+    // if this much is left in max_buffer_bytes
+    std::size_t buffer_bytes_per_connection{2 * Buffer::kDEFAULT_BUFFER_CAPACITY};
+    overload_action on_overload{overload_action::Pause};
+};
+
+struct admission_stats
+{
+    std::size_t active{0};       // admitted connections still open
+    std::size_t buffer_bytes{0}; // held by their buffers
+    uint64_t admitted{0};
+    uint64_t shed{0};            // accepted and closed right away
+    uint64_t pauses{0};          // times an acceptor stopped accepting
+    std::vector<std::size_t> active_per_worker;
+};
+
+
+class admission_control;
+
+/// an admitted connection's slot, released on destruction. buffer memory
+/// the connection allocates is charged to it.
+class admission_ticket
+{
+public:
+    admission_ticket() noexcept = default;
+    admission_ticket(admission_control* control, int worker) noexcept
+        : control_(control), worker_(worker)
+    {}
+
+    admission_ticket(const admission_ticket&) = delete;
+    admission_ticket& operator=(const admission_ticket&) = delete;
+
+    admission_ticket(admission_ticket&& other) noexcept
+        : control_(std::exchange(other.control_, nullptr))
+        , worker_(other.worker_)
+        , charged_(std::exchange(other.charged_, 0))
+    {}
+
+    admission_ticket& operator=(admission_ticket&& other) noexcept {
+        if (this == &other) return *this;
+        release();
+        control_ = std::exchange(other.control_, nullptr);
+        worker_ = other.worker_;
+        charged_ = std::exchange(other.charged_, 0);
+        return *this;
+    }
+
+    ~admission_ticket() noexcept { release(); }
+
+    explicit operator bool() const noexcept { return control_ != nullptr; }
+
+    /// worker the connection runs on, the one it was admitted on unless it
+    /// was stolen
+    int worker() const noexcept { return worker_; }
+
+    /// the connection moved to `worker`, e.g. a neighbour stole its session.
+    /// keeps the per worker counts exact, it isn't checked against the cap.
+    inline void move_to(int worker) noexcept;
+
+    inline void charge(std::size_t bytes) noexcept;
+    inline void uncharge(std::size_t bytes) noexcept;
+    inline void release() noexcept;
+
+private:
+    admission_control* control_{nullptr};
+    int worker_{-1};
+    std::size_t charged_{0};
+};
+
+
+// 准入控制：acceptor在accept之后、分配Connection之前调用try_admit()，
+// 全局连接数、每个worker的连接数和连接缓冲区的内存都有上限。超出预算时
+// acceptor可以暂停accept（连接留在内核的backlog里）或者直接关闭新连接，
+// 而不是无限制地分配内存和排队。计数都是原子变量，连接在worker线程上关闭
+// 时释放名额，并唤醒暂停的acceptor。
+class admission_control
+{
+public:
+    admission_control(const admission_limits& limits, std::size_t n_workers)
+        : limits_(limits)
+        , workers_(std::make_unique<std::atomic<std::size_t>[]>(n_workers))
+        , n_workers_(n_workers)
+    {
+        for (std::size_t i=0; i<n_workers_; ++i)
+            workers_[i].store(0, std::memory_order_relaxed);
+    }
+
+    admission_control(const admission_control&) = delete;
+    admission_control& operator=(const admission_control&) = delete;
+
+    const admission_limits& limits() const noexcept { return limits_; }
+
+    /// reserve a slot for a new connection, on `preferred` if it has room
+    /// (-1: none), else on the next worker with room in round robin order.
+    /// \return an empty ticket if the server is over budget.
+    admission_ticket try_admit(int preferred = -1) noexcept {
+        if (!buffers_have_room())
+            return {};
+        if (limits_.max_connections > 0) {
+            if (active_.fetch_add(1) >= limits_.max_connections) {
+                active_.fetch_sub(1);
+                return {};
+            }
+        } else {
+            active_.fetch_add(1);
+        }
+
+        int worker = pick_worker(preferred);
+        if (worker < 0) {
+            active_.fetch_sub(1);
+            return {};
+        }
+        admitted_.fetch_add(1, std::memory_order_relaxed);
+        return admission_ticket{this, worker};
+    }
+
+    /// whether a connection could be admitted, on `worker` or (-1) on any
+    bool has_room(int worker = -1) const noexcept {
+        if (!buffers_have_room())
+            return false;
+        if (limits_.max_connections > 0 && active_.load() >= limits_.max_connections)
+            return false;
+        if (limits_.max_connections_per_worker == 0)
+            return true;
+        if (worker >= 0)
+            return workers_[worker].load() < limits_.max_connections_per_worker;
+        for (std::size_t i=0; i<n_workers_; ++i) {
+            if (workers_[i].load() < limits_.max_connections_per_worker)
+                return true;
+        }
+        return false;
+    }
+
+    /// suspend until has_room(worker) or wake_all(). the caller resumes on
+    /// its own ring.
+    task<> wait_for_room(int worker = -1) {
+        pauses_.fetch_add(1, std::memory_order_relaxed);
+        paused_.fetch_add(1);
+        while (!woken_all_.load(std::memory_order_acquire)) {
+            room_.reset();
+            // released slots after this check set the event, see release()
+            if (has_room(worker)) break;
+            co_await room_.wait();
+        }
+        paused_.fetch_sub(1);
+    }
+
+    /// resume every paused acceptor for good, e.g. on shutdown
+    void wake_all() {
+        woken_all_.store(true, std::memory_order_release);
+        room_.set();
+    }
+
+    void count_shed() noexcept { shed_.fetch_add(1, std::memory_order_relaxed); }
+
+    admission_stats stats() const {
+        admission_stats s;
+        s.active = active_.load(std::memory_order_relaxed);
+        s.buffer_bytes = buffer_bytes_.load(std::memory_order_relaxed);
+        s.admitted = admitted_.load(std::memory_order_relaxed);
+        s.shed = shed_.load(std::memory_order_relaxed);
+        s.pauses = pauses_.load(std::memory_order_relaxed);
+        s.active_per_worker.reserve(n_workers_);
+        for (std::size_t i=0; i<n_workers_; ++i)
+            s.active_per_worker.push_back(workers_[i].load(std::memory_order_relaxed));
+        return s;
+    }
+
+private:
+    friend class admission_ticket;
+
+    bool buffers_have_room() const noexcept {
+        return limits_.max_buffer_bytes == 0
+            || buffer_bytes_.load() + limits_.buffer_bytes_per_connection <= limits_.max_buffer_bytes;
+    }
+
+    int pick_worker(int preferred) noexcept {
+        auto cap = limits_.max_connections_per_worker;
+        auto try_take = [&](std::size_t i) {
+            if (cap == 0) {
+                workers_[i].fetch_add(1);
+                return true;
+            }
+            auto n = workers_[i].load();
+            while (n < cap) {
+                if (workers_[i].compare_exchange_weak(n, n + 1))
+                    return true;
+            }
+            return false;
+        };
+        if (preferred >= 0 && try_take(preferred))
+            return preferred;
+        auto start = next_worker_.fetch_add(1, std::memory_order_relaxed);
+        for (std::size_t k=0; k<n_workers_; ++k) {
+            auto i = (start + k) % n_workers_;
+            if (try_take(i))
+                return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    void charge(std::size_t bytes) noexcept { buffer_bytes_.fetch_add(bytes); }
+
+    void uncharge(std::size_t bytes) {
+        buffer_bytes_.fetch_sub(bytes);
+        wake_paused();
+    }
+
+    void move(int from, int to) {
+        workers_[to].fetch_add(1);
+        workers_[from].fetch_sub(1);
+        wake_paused();
+    }
+
+    void release(int worker, std::size_t bytes) {
+        buffer_bytes_.fetch_sub(bytes);
+        workers_[worker].fetch_sub(1);
+        active_.fetch_sub(1);
+        wake_paused();
+    }
+
+    void wake_paused() {
+        // seq_cst pairs with wait_for_room(): either it sees the room or
+        // we see it paused
+        if (paused_.load() > 0)
+            room_.set();
+    }
+
+    admission_limits limits_;
+    std::unique_ptr<std::atomic<std::size_t>[]> workers_;
+    std::size_t n_workers_;
+    std::atomic<std::size_t> next_worker_{0};
+    std::atomic<std::size_t> active_{0};
+    std::atomic<std::size_t> buffer_bytes_{0};
+    std::atomic<std::size_t> paused_{0};
+    std::atomic<bool> woken_all_{false};
+    std::atomic<uint64_t> admitted_{0};
+    std::atomic<uint64_t> shed_{0};
+    std::atomic<uint64_t> pauses_{0};
+    async_event room_;
+};
+
+
+inline void admission_ticket::charge(std::size_t bytes) noexcept {
+    if (control_ == nullptr) return;
+    charged_ += bytes;
+    control_->charge(bytes);
+}
+
+inline void admission_ticket::uncharge(std::size_t bytes) noexcept {
+    if (control_ == nullptr) return;
+    bytes = std::min(bytes, charged_);
+    charged_ -= bytes;
+    control_->uncharge(bytes);
+}
+
+inline void admission_ticket::move_to(int worker) noexcept {
+    if (control_ == nullptr || worker == worker_) return;
+    control_->move(worker_, worker);
+    worker_ = worker;
+}
+
+inline void admission_ticket::release() noexcept {
+    if (control_ == nullptr) return;
+    std::exchange(control_, nullptr)->release(worker_, std::exchange(charged_, 0));
+}
+
+
+}
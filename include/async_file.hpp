@@ -67,13 +67,17 @@ public:
 
 
     ~async_file() {
-        if (fd_ > 0)
+        if (fd_ > 0) {
+            ios_.unregister_file(fd_);
             close(fd_);
+        }
         std::cout << "file closed" << std::endl;
     }
 
     task<int> open() {
         fd_ = co_await open_impl();
+        // later reads/writes go through the ring's file table, if it has one
+        ios_.register_file(fd_);
         co_return fd_;
     }
 
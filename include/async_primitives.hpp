@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+#include "io_service.hpp"
+
+namespace sheep {
+
+
+namespace detail {
+
+
+/// a suspended coroutine parked on a primitive, lives in the awaiter (i.e.
+/// in the coroutine frame). a parked coroutine must not be destroyed.
+struct waiter
+{
+    std::coroutine_handle<> coro;
+    io_service* owner{nullptr}; // ring the coroutine runs on
+    waiter* next{nullptr};
+
+    /// resume on the owning ring, or inline when parked off any ring thread
+    void wake() {
+        if (owner != nullptr)
+            owner->post(coro);
+        else
+            coro.resume();
+    }
+};
+
+
+/// fifo of waiters, guarded by the mutex of the primitive owning it
+class waiter_queue
+{
+public:
+    void push_back(waiter& w) noexcept {
+        w.next = nullptr;
+        if (tail_) tail_->next = &w;
+        else head_ = &w;
+        tail_ = &w;
+    }
+
+    waiter* pop_front() noexcept {
+        auto w = head_;
+        if (w != nullptr) {
+            head_ = w->next;
+            if (head_ == nullptr) tail_ = nullptr;
+        }
+        return w;
+    }
+
+    /// detach all waiters, they are woken by walking `next`
+    waiter* take_all() noexcept {
+        tail_ = nullptr;
+        return std::exchange(head_, nullptr);
+    }
+
+    bool empty() const noexcept { return head_ == nullptr; }
+
+private:
+    waiter* head_{nullptr};
+    waiter* tail_{nullptr};
+};
+
+
+inline void wake_all(waiter* w) {
+    while (w != nullptr) {
+        // the woken coroutine may resume inline and reuse the node
+        auto next = w->next;
+        w->wake();
+        w = next;
+    }
+}
+
+
+} // namespace detail
+
+
+// 以下同步原语都不会阻塞线程：拿不到资源的协程挂起在等待队列上，
+// 被唤醒时通过io_service::post()回到它原来所在的ring（线程）上继续执行，
+// 协程绑定的连接和io都不会跨线程。内部的std::mutex只保护等待队列，
+// 持有时间极短，从不跨越挂起点。
+
+
+/// a mutex that suspends the awaiting coroutine instead of the thread.
+/// ownership is handed directly to the next waiter on unlock (fifo), so
+/// waiters never starve.
+class async_mutex
+{
+public:
+    async_mutex() noexcept = default;
+    async_mutex(const async_mutex&) = delete;
+    async_mutex& operator=(const async_mutex&) = delete;
+
+    bool try_lock() noexcept {
+        std::lock_guard<std::mutex> g{mutex_};
+        if (locked_) return false;
+        locked_ = true;
+        return true;
+    }
+
+    /// co_await m.lock(); ... m.unlock();
+    auto lock() noexcept {
+        struct awaiter
+        {
+            async_mutex* m_;
+            detail::waiter waiter_;
+
+            bool await_ready() noexcept { return m_->try_lock(); }
+            bool await_suspend(std::coroutine_handle<> coro) noexcept {
+                std::lock_guard<std::mutex> g{m_->mutex_};
+                if (!m_->locked_) {
+                    m_->locked_ = true;
+                    return false;
+                }
+                waiter_.coro = coro;
+                waiter_.owner = io_service::current();
+                m_->waiters_.push_back(waiter_);
+                return true;
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this, {}};
+    }
+
+    void unlock() {
+        detail::waiter* next;
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            assert(locked_);
+            next = waiters_.pop_front();
+            // stays locked, the waiter owns it now
+            if (next == nullptr)
+                locked_ = false;
+        }
+        if (next != nullptr)
+            next->wake();
+    }
+
+    class [[nodiscard]] guard
+    {
+    public:
+        explicit guard(async_mutex* m) noexcept : m_(m) {}
+        guard(guard&& other) noexcept : m_(std::exchange(other.m_, nullptr)) {}
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+        ~guard() { if (m_) m_->unlock(); }
+
+    private:
+        async_mutex* m_;
+    };
+
+    /// auto lk = co_await m.scoped_lock(); unlocks when lk is destroyed
+    auto scoped_lock() noexcept {
+        struct awaiter
+        {
+            decltype(std::declval<async_mutex>().lock()) inner_;
+
+            bool await_ready() noexcept { return inner_.await_ready(); }
+            bool await_suspend(std::coroutine_handle<> coro) noexcept {
+                return inner_.await_suspend(coro);
+            }
+            guard await_resume() const noexcept { return guard{inner_.m_}; }
+        };
+        return awaiter{lock()};
+    }
+
+private:
+    std::mutex mutex_;
+    bool locked_{false};
+    detail::waiter_queue waiters_;
+};
+
+
+/// a counting semaphore for coroutines, e.g. to bound the number of
+/// concurrent backend calls. permits go to waiters in fifo order.
+class async_semaphore
+{
+public:
+    explicit async_semaphore(std::size_t permits) noexcept : permits_(permits) {}
+    async_semaphore(const async_semaphore&) = delete;
+    async_semaphore& operator=(const async_semaphore&) = delete;
+
+    bool try_acquire() noexcept {
+        std::lock_guard<std::mutex> g{mutex_};
+        if (permits_ == 0) return false;
+        --permits_;
+        return true;
+    }
+
+    auto acquire() noexcept {
+        struct awaiter
+        {
+            async_semaphore* s_;
+            detail::waiter waiter_;
+
+            bool await_ready() noexcept { return s_->try_acquire(); }
+            bool await_suspend(std::coroutine_handle<> coro) noexcept {
+                std::lock_guard<std::mutex> g{s_->mutex_};
+                if (s_->permits_ > 0) {
+                    --s_->permits_;
+                    return false;
+                }
+                waiter_.coro = coro;
+                waiter_.owner = io_service::current();
+                s_->waiters_.push_back(waiter_);
+                return true;
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this, {}};
+    }
+
+    void release(std::size_t n = 1) {
+        detail::waiter* woken = nullptr;
+        detail::waiter* tail = nullptr;
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            for (; n > 0; --n) {
+                auto w = waiters_.pop_front();
+                if (w == nullptr) break;
+                // the permit goes straight to the waiter
+                w->next = nullptr;
+                if (tail) tail->next = w;
+                else woken = w;
+                tail = w;
+            }
+            permits_ += n;
+        }
+        detail::wake_all(woken);
+    }
+
+    /// permits currently available, for monitoring only
+    std::size_t available() noexcept {
+        std::lock_guard<std::mutex> g{mutex_};
+        return permits_;
+    }
+
+private:
+    std::mutex mutex_;
+    std::size_t permits_;
+    detail::waiter_queue waiters_;
+};
+
+
+/// an event coroutines wait on.
+/// manual reset: set() wakes every waiter and the event stays set until reset().
+/// auto reset: set() wakes a single waiter, or lets the next wait() pass if
+/// nobody is waiting; a passing wait() resets the event.
+class async_event
+{
+public:
+    enum class reset_mode { Manual, Auto };
+
+    explicit async_event(reset_mode mode = reset_mode::Manual, bool set = false) noexcept
+        : mode_(mode), set_(set)
+    {}
+    async_event(const async_event&) = delete;
+    async_event& operator=(const async_event&) = delete;
+
+    auto wait() noexcept {
+        struct awaiter
+        {
+            async_event* ev_;
+            detail::waiter waiter_;
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> coro) noexcept {
+                std::lock_guard<std::mutex> g{ev_->mutex_};
+                if (ev_->set_) {
+                    if (ev_->mode_ == reset_mode::Auto)
+                        ev_->set_ = false;
+                    return false;
+                }
+                waiter_.coro = coro;
+                waiter_.owner = io_service::current();
+                ev_->waiters_.push_back(waiter_);
+                return true;
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this, {}};
+    }
+
+    void set() {
+        detail::waiter* woken = nullptr;
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            if (mode_ == reset_mode::Manual) {
+                set_ = true;
+                woken = waiters_.take_all();
+            } else {
+                woken = waiters_.pop_front();
+                if (woken != nullptr) woken->next = nullptr;
+                else set_ = true;
+            }
+        }
+        detail::wake_all(woken);
+    }
+
+    void reset() noexcept {
+        std::lock_guard<std::mutex> g{mutex_};
+        set_ = false;
+    }
+
+    bool is_set() noexcept {
+        std::lock_guard<std::mutex> g{mutex_};
+        return set_;
+    }
+
+private:
+    std::mutex mutex_;
+    reset_mode mode_;
+    bool set_;
+    detail::waiter_queue waiters_;
+};
+
+
+}
@@ -4,6 +4,8 @@
 #include <cstring>
 #include <string_view>
 
+#include "slab_pool.hpp"
+
 namespace sheep {
 
 
@@ -15,12 +17,15 @@ public:
         : size_(0)
         , capacity_(capacity)
     {
-        buf_ = static_cast<std::byte*>(std::malloc(sizeof(std::byte) * capacity_));
+        buf_ = allocate_storage(capacity_);
     }
 
     Buffer(const Buffer&) = delete;
     Buffer& operator=(const Buffer&) = delete;
 
+    static void* operator new(std::size_t size) { return detail::slab_new<Buffer>(size); }
+    static void operator delete(void* p, std::size_t size) noexcept { detail::slab_delete<Buffer>(p, size); }
+
     Buffer(Buffer&& other) noexcept 
         : buf_(other.buf_), size_(other.size_), capacity_(other.capacity_)
     {
@@ -40,18 +45,18 @@ public:
 
     friend void swap(Buffer&, Buffer&) noexcept;
     ~Buffer() {
-        std::free(buf_); // its safe to free nullptr
+        free_storage(buf_, capacity_);
     }
 
     std::size_t size() const noexcept { return size_; }
     std::size_t capacity() const noexcept { return capacity_; }
     void set_size(std::size_t written) noexcept { size_ = written; }
 
-    void clear() { if (size_) std::memset(buf_, 0, sizeof(std::byte) * size_); }
+    // only forgets the contents, the bytes are overwritten by the next read
+    void clear() noexcept { size_ = 0; }
     const unsigned char* data() const noexcept { return reinterpret_cast<const unsigned char*>(buf_); }
 
     void write(const unsigned char* data, std::size_t write_size) {
-        clear();
         size_ = write_size;
         std::memcpy(buf_, data, size_);
     }
@@ -61,6 +66,23 @@ public:
     }
 
 private:
+    // default sized storage comes from the slab pool, other sizes from malloc
+    using storage_pool = detail::slab_pool<kDEFAULT_BUFFER_CAPACITY>;
+
+    static std::byte* allocate_storage(std::size_t capacity) {
+        if (capacity == kDEFAULT_BUFFER_CAPACITY)
+            return static_cast<std::byte*>(storage_pool::allocate());
+        return static_cast<std::byte*>(std::malloc(sizeof(std::byte) * capacity));
+    }
+
+    static void free_storage(std::byte* buf, std::size_t capacity) noexcept {
+        if (buf == nullptr) return;
+        if (capacity == kDEFAULT_BUFFER_CAPACITY)
+            storage_pool::deallocate(buf);
+        else
+            std::free(buf);
+    }
+
     std::byte* buf_;
     std::size_t size_;
     std::size_t capacity_;
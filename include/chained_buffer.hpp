@@ -0,0 +1,357 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <sys/uio.h>
+
+#include "slab_pool.hpp"
+
+namespace sheep {
+
+
+namespace detail {
+
+
+/// fixed size segment of a chained_buffer, the bytes follow the header
+struct buffer_segment
+{
+    buffer_segment* next{nullptr};
+    uint32_t begin{0}; // first unread byte
+    uint32_t end{0};   // one past the last written byte
+
+    std::byte* data() noexcept { return reinterpret_cast<std::byte*>(this + 1); }
+    const std::byte* data() const noexcept { return reinterpret_cast<const std::byte*>(this + 1); }
+};
+
+
+// 分段从slab_pool中分配：在哪个线程分配，释放后就回到哪个线程的池子
+class segment_pool
+{
+public:
+    static constexpr std::size_t kBLOCK_SIZE = 4096;
+    static constexpr std::size_t kCAPACITY = kBLOCK_SIZE - sizeof(buffer_segment);
+
+    static buffer_segment* allocate() {
+        return ::new (slab_pool<kBLOCK_SIZE>::allocate()) buffer_segment{};
+    }
+
+    static void deallocate(buffer_segment* seg) noexcept {
+        slab_pool<kBLOCK_SIZE>::deallocate(seg);
+    }
+};
+
+
+} // namespace detail
+
+
+/// a growable byte queue made of pooled fixed size segments: appending never
+/// moves existing bytes, consuming from the front frees whole segments, and
+/// both the data and the spare capacity are exposed as iovecs so a socket can
+/// be read into or written from the chain with one recvmsg/sendmsg.
+class chained_buffer
+{
+public:
+    static constexpr std::size_t kSEGMENT_SIZE = detail::segment_pool::kCAPACITY;
+    // iovecs handed to a single recvmsg/sendmsg
+    static constexpr std::size_t kMAX_IOVECS = 32;
+
+    /// told about the segment memory of a buffer, see set_account()
+    using account_fn = void (*)(void* ctx, std::ptrdiff_t bytes) noexcept;
+
+    chained_buffer() noexcept = default;
+    chained_buffer(const chained_buffer&) = delete;
+    chained_buffer& operator=(const chained_buffer&) = delete;
+
+    /// the segments take their account along
+    chained_buffer(chained_buffer&& other) noexcept
+        : head_(std::exchange(other.head_, nullptr))
+        , tail_(std::exchange(other.tail_, nullptr))
+        , fill_(std::exchange(other.fill_, nullptr))
+        , size_(std::exchange(other.size_, 0))
+        , account_(std::exchange(other.account_, nullptr))
+        , account_ctx_(std::exchange(other.account_ctx_, nullptr))
+    {}
+
+    chained_buffer& operator=(chained_buffer&& other) noexcept {
+        if (this == &other) return *this;
+        release();
+        head_ = std::exchange(other.head_, nullptr);
+        tail_ = std::exchange(other.tail_, nullptr);
+        fill_ = std::exchange(other.fill_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        account_ = std::exchange(other.account_, nullptr);
+        account_ctx_ = std::exchange(other.account_ctx_, nullptr);
+        return *this;
+    }
+
+    ~chained_buffer() noexcept { release(); }
+
+    /// report the memory of the segments to `fn(ctx, bytes)`: positive when
+    /// segments are allocated or taken from another buffer, negative when
+    /// they are freed or handed over. the segments held now move from the
+    /// previous account to this one, nullptr stops accounting.
+    void set_account(account_fn fn, void* ctx) noexcept {
+        auto held = static_cast<std::ptrdiff_t>(segments() * detail::segment_pool::kBLOCK_SIZE);
+        account(-held);
+        account_ = fn;
+        account_ctx_ = ctx;
+        account(held);
+    }
+
+    /// the account's context moved, e.g. along with the object owning the
+    /// buffer. nothing is reported, the segments are charged to it already.
+    void rebind_account(void* ctx) noexcept { account_ctx_ = ctx; }
+
+    /// segments held, data and spare ones
+    std::size_t segments() const noexcept {
+        std::size_t n = 0;
+        for (auto seg = head_; seg != nullptr; seg = seg->next)
+            ++n;
+        return n;
+    }
+
+    /// readable bytes
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    void append(const void* data, std::size_t n) {
+        reserve(n);
+        auto src = static_cast<const std::byte*>(data);
+        for (auto seg = fill_; n > 0; seg = seg->next) {
+            auto k = std::min<std::size_t>(n, kSEGMENT_SIZE - seg->end);
+            std::memcpy(seg->data() + seg->end, src, k);
+            src += k;
+            n -= k;
+            commit(k);
+        }
+    }
+
+    void append(std::string_view s) { append(s.data(), s.size()); }
+
+    /// move the bytes of `other` behind ours, relinking its segments
+    void append(chained_buffer&& other) noexcept {
+        if (other.empty()) return;
+        trim_spare();
+        if (account_ != other.account_ || account_ctx_ != other.account_ctx_) {
+            auto moved = static_cast<std::ptrdiff_t>(other.segments() * detail::segment_pool::kBLOCK_SIZE);
+            other.account(-moved);
+            account(moved);
+        }
+        if (tail_ != nullptr) tail_->next = other.head_;
+        else head_ = other.head_;
+        tail_ = std::exchange(other.tail_, nullptr);
+        fill_ = std::exchange(other.fill_, nullptr);
+        size_ += std::exchange(other.size_, 0);
+        other.head_ = nullptr;
+    }
+
+    /// copy up to `n` bytes starting `offset` bytes in, without consuming
+    /// \return bytes copied.
+    std::size_t peek(void* out, std::size_t n, std::size_t offset = 0) const noexcept {
+        auto dst = static_cast<std::byte*>(out);
+        std::size_t copied = 0;
+        for (auto seg = head_; seg != nullptr && copied < n; seg = seg->next) {
+            std::size_t avail = seg->end - seg->begin;
+            if (offset >= avail) {
+                offset -= avail;
+                continue;
+            }
+            auto k = std::min(avail - offset, n - copied);
+            std::memcpy(dst + copied, seg->data() + seg->begin + offset, k);
+            copied += k;
+            offset = 0;
+        }
+        return copied;
+    }
+
+    /// drop up to `n` bytes from the front, emptied segments are freed
+    /// \return bytes dropped.
+    std::size_t consume(std::size_t n) noexcept {
+        n = std::min(n, size_);
+        size_ -= n;
+        auto left = n;
+        while (head_ != nullptr) {
+            auto k = std::min<std::size_t>(left, head_->end - head_->begin);
+            head_->begin += k;
+            left -= k;
+            if (head_->begin != head_->end)
+                break;
+            if (head_ == fill_ || head_->end == 0) {
+                // keep the segment being filled, its spare room is reused
+                head_->begin = head_->end = 0;
+                break;
+            }
+            pop_front();
+        }
+        return n;
+    }
+
+    void clear() noexcept { consume(size_); }
+
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    /// offset of the first occurrence of `needle` at or after `from`, which
+    /// may span segments. \return npos if there is none.
+    std::size_t find(std::string_view needle, std::size_t from = 0) const noexcept {
+        if (needle.empty()) return from <= size_ ? from : npos;
+        std::size_t base = 0; // offset of the segment's first readable byte
+        for (auto seg = head_; seg != nullptr; seg = seg->next) {
+            std::size_t len = seg->end - seg->begin;
+            if (from < base + len) {
+                auto bytes = reinterpret_cast<const char*>(seg->data() + seg->begin);
+                for (auto i = from - base; i < len; ++i) {
+                    auto hit = static_cast<const char*>(std::memchr(bytes + i, needle[0], len - i));
+                    if (hit == nullptr) break;
+                    i = hit - bytes;
+                    if (matches(seg, i, needle))
+                        return base + i;
+                }
+                from = base + len;
+            }
+            base += len;
+        }
+        return npos;
+    }
+
+    /// the readable bytes of the first segment
+    std::span<const std::byte> front() const noexcept {
+        if (head_ == nullptr) return {};
+        return {head_->data() + head_->begin, head_->end - head_->begin};
+    }
+
+    /// describe the readable bytes, at most out.size() segments.
+    /// \return number of iovecs filled.
+    std::size_t data_iovecs(std::span<iovec> out) const noexcept {
+        std::size_t n = 0;
+        for (auto seg = head_; seg != nullptr && n < out.size(); seg = seg->next) {
+            if (seg->end == seg->begin) continue;
+            out[n++] = iovec{const_cast<std::byte*>(seg->data() + seg->begin), seg->end - seg->begin};
+        }
+        return n;
+    }
+
+    /// grow the spare capacity to at least `min_bytes` (whole segments) and
+    /// describe it, at most out.size() segments. write into it, then commit().
+    /// \return number of iovecs filled.
+    std::size_t prepare(std::span<iovec> out, std::size_t min_bytes = kSEGMENT_SIZE) {
+        reserve(min_bytes);
+        std::size_t n = 0;
+        for (auto seg = fill_; seg != nullptr && n < out.size(); seg = seg->next)
+            out[n++] = iovec{seg->data() + seg->end, kSEGMENT_SIZE - seg->end};
+        return n;
+    }
+
+    /// make `n` bytes written into the prepared capacity readable
+    void commit(std::size_t n) noexcept {
+        size_ += n;
+        while (n > 0) {
+            auto k = std::min<std::size_t>(n, kSEGMENT_SIZE - fill_->end);
+            fill_->end += k;
+            n -= k;
+            if (fill_->end == kSEGMENT_SIZE)
+                fill_ = fill_->next;
+        }
+    }
+
+    /// spare bytes before the buffer has to allocate
+    std::size_t spare() const noexcept {
+        std::size_t n = 0;
+        for (auto seg = fill_; seg != nullptr; seg = seg->next)
+            n += kSEGMENT_SIZE - seg->end;
+        return n;
+    }
+
+    /// copy of the readable bytes, for logging and tests
+    std::string to_string() const {
+        std::string s(size_, '\0');
+        peek(s.data(), s.size());
+        return s;
+    }
+
+private:
+    /// whether `needle` starts at byte `i` of `seg`'s readable bytes
+    static bool matches(const detail::buffer_segment* seg, std::size_t i, std::string_view needle) noexcept {
+        std::size_t pos = seg->begin + i;
+        for (char c: needle) {
+            while (seg != nullptr && pos == seg->end) {
+                seg = seg->next;
+                if (seg != nullptr) pos = seg->begin;
+            }
+            if (seg == nullptr || static_cast<char>(seg->data()[pos]) != c)
+                return false;
+            ++pos;
+        }
+        return true;
+    }
+
+    void reserve(std::size_t n) {
+        auto have = spare();
+        while (have < n) {
+            auto seg = detail::segment_pool::allocate();
+            account(detail::segment_pool::kBLOCK_SIZE);
+            if (tail_ != nullptr) tail_->next = seg;
+            else head_ = seg;
+            tail_ = seg;
+            if (fill_ == nullptr) fill_ = seg;
+            have += kSEGMENT_SIZE;
+        }
+    }
+
+    void free_segment(detail::buffer_segment* seg) noexcept {
+        detail::segment_pool::deallocate(seg);
+        account(-static_cast<std::ptrdiff_t>(detail::segment_pool::kBLOCK_SIZE));
+    }
+
+    void account(std::ptrdiff_t bytes) noexcept {
+        if (account_ != nullptr && bytes != 0) account_(account_ctx_, bytes);
+    }
+
+    void pop_front() noexcept {
+        auto seg = std::exchange(head_, head_->next);
+        if (head_ == nullptr) tail_ = fill_ = nullptr;
+        free_segment(seg);
+    }
+
+    /// free the unused segments behind the data, so appended data follows it
+    void trim_spare() noexcept {
+        if (fill_ == nullptr) return;
+        auto keep = fill_->end > 0 ? fill_ : nullptr;
+        // the segment holding the last bytes, if fill_ is still empty
+        if (keep == nullptr) {
+            for (auto seg = head_; seg != fill_; seg = seg->next)
+                keep = seg;
+        }
+        auto seg = keep != nullptr ? keep->next : head_;
+        while (seg != nullptr)
+            free_segment(std::exchange(seg, seg->next));
+        if (keep != nullptr) keep->next = nullptr;
+        else head_ = nullptr;
+        tail_ = keep;
+        fill_ = nullptr;
+    }
+
+    void release() noexcept {
+        while (head_ != nullptr)
+            free_segment(std::exchange(head_, head_->next));
+        tail_ = fill_ = nullptr;
+        size_ = 0;
+    }
+
+    detail::buffer_segment* head_{nullptr};
+    detail::buffer_segment* tail_{nullptr};
+    // first segment with spare room behind the data, nullptr if none
+    detail::buffer_segment* fill_{nullptr};
+    std::size_t size_{0};
+    account_fn account_{nullptr};
+    void* account_ctx_{nullptr};
+};
+
+
+}
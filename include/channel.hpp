@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "async_primitives.hpp"
+#include "mpmc_queue.hpp"
+#include "task.hpp"
+
+namespace sheep {
+
+
+/// a bounded multi-producer multi-consumer channel between coroutines,
+/// possibly on different workers. values are buffered in an MPMCQueue, a
+/// full channel suspends senders and an empty one suspends receivers; both
+/// resume on their own ring. T must be default constructible and movable.
+///
+/// the queue operations stay lock free, the mutex only guards the waiter
+/// lists: a coroutine announces itself (waiting counter) before it re-checks
+/// the queue, and the other side checks the counter after touching the
+/// queue, so at least one of them sees the other and no wakeup is lost.
+template <typename T>
+class channel
+{
+public:
+    /// \param capacity number of buffered values, must be a power of 2.
+    explicit channel(uint64_t capacity) : queue_(capacity) {}
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+
+    /// \return false if the channel is full or closed, `value` is left
+    /// untouched then.
+    bool try_send(T&& value) {
+        if (!push(value)) return false;
+        wake_one(receivers_, receivers_waiting_);
+        return true;
+    }
+
+    std::optional<T> try_recv() {
+        std::optional<T> out;
+        if (!pop(out)) return std::nullopt;
+        wake_one(senders_, senders_waiting_);
+        return out;
+    }
+
+    /// suspend while the channel is full.
+    /// \return false if the channel was closed, the value is dropped.
+    task<bool> send(T value) {
+        for (;;) {
+            if (co_await park(senders_, senders_waiting_, [&] { return push(value); })) {
+                wake_one(receivers_, receivers_waiting_);
+                co_return true;
+            }
+            if (closed_.load(std::memory_order_acquire))
+                co_return false;
+        }
+    }
+
+    /// suspend while the channel is empty.
+    /// \return std::nullopt once the channel is closed and drained.
+    task<std::optional<T>> recv() {
+        std::optional<T> out;
+        for (;;) {
+            // values sent before close() are still delivered
+            bool closed = closed_.load(std::memory_order_acquire);
+            if (co_await park(receivers_, receivers_waiting_, [&] { return pop(out); })) {
+                wake_one(senders_, senders_waiting_);
+                co_return out;
+            }
+            if (closed)
+                co_return std::nullopt;
+        }
+    }
+
+    /// reject further sends and wake every waiter
+    void close() {
+        detail::waiter* senders;
+        detail::waiter* receivers;
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            closed_.store(true, std::memory_order_release);
+            senders = senders_.take_all();
+            receivers = receivers_.take_all();
+            senders_waiting_.store(0, std::memory_order_relaxed);
+            receivers_waiting_.store(0, std::memory_order_relaxed);
+        }
+        detail::wake_all(senders);
+        detail::wake_all(receivers);
+    }
+
+    bool closed() const noexcept { return closed_.load(std::memory_order_acquire); }
+
+private:
+    // raw queue operations, the caller wakes the other side. they run under
+    // mutex_ in park(), so they must not wake anyone themselves
+    bool push(T& value) {
+        if (closed_.load(std::memory_order_acquire)) return false;
+        return queue_.try_push(std::move(value));
+    }
+
+    bool pop(std::optional<T>& out) {
+        T value;
+        if (!queue_.try_pop(value)) return false;
+        out.emplace(std::move(value));
+        return true;
+    }
+
+    /// run `op` and suspend until woken if it fails.
+    /// \return true if `op` succeeded, false after a wakeup (retry) or close.
+    template <typename Op>
+    auto park(detail::waiter_queue& queue, std::atomic<std::size_t>& waiting, Op op) {
+        struct awaiter
+        {
+            channel* ch_;
+            detail::waiter_queue& queue_;
+            std::atomic<std::size_t>& waiting_;
+            Op op_;
+            detail::waiter waiter_{};
+            bool done_{false};
+
+            bool await_ready() { return done_ = op_(); }
+            bool await_suspend(std::coroutine_handle<> coro) {
+                std::lock_guard<std::mutex> g{ch_->mutex_};
+                if (ch_->closed_.load(std::memory_order_acquire))
+                    return false;
+                waiting_.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if ((done_ = op_())) {
+                    waiting_.fetch_sub(1);
+                    return false;
+                }
+                waiter_.coro = coro;
+                waiter_.owner = io_service::current();
+                queue_.push_back(waiter_);
+                return true;
+            }
+            bool await_resume() const noexcept { return done_; }
+        };
+        return awaiter{this, queue, waiting, std::move(op)};
+    }
+
+    void wake_one(detail::waiter_queue& queue, std::atomic<std::size_t>& waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) == 0)
+            return;
+        detail::waiter* w;
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            w = queue.pop_front();
+            if (w != nullptr)
+                waiting.fetch_sub(1);
+        }
+        if (w != nullptr)
+            w->wake();
+    }
+
+    MPMCQueue<T> queue_;
+    std::mutex mutex_;
+    detail::waiter_queue senders_;
+    detail::waiter_queue receivers_;
+    std::atomic<std::size_t> senders_waiting_{0};
+    std::atomic<std::size_t> receivers_waiting_{0};
+    std::atomic<bool> closed_{false};
+};
+
+
+}
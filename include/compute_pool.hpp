@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "io_service.hpp"
+
+namespace sheep {
+
+
+namespace detail {
+
+
+/// intrusive job node, lives in the awaiting coroutine's frame
+struct compute_job
+{
+    void (*run)(compute_job*) noexcept {nullptr};
+    compute_job* next{nullptr};
+};
+
+
+} // namespace detail
+
+
+// 计算线程池：与io线程(thread_pool)分开，专门执行CPU密集的任务（压缩、哈希、
+// JSON等），避免阻塞ring上的其他协程。协程co_await offload(fn)后挂起，
+// fn在计算线程上执行，完成后协程通过io_service::post()回到原来的ring继续执行。
+// 计算线程可以阻塞等待任务，所以这里用条件变量而不是eventfd。
+class compute_pool
+{
+public:
+    explicit compute_pool(std::size_t n_threads) {
+        n_threads = std::max<std::size_t>(n_threads, 1);
+        threads_.reserve(n_threads);
+        for (std::size_t i=0; i<n_threads; ++i)
+            threads_.emplace_back([this](std::stop_token st) { work(st); });
+    }
+
+    compute_pool(const compute_pool&) = delete;
+    compute_pool& operator=(const compute_pool&) = delete;
+
+    /// queued jobs are still run before the threads exit
+    ~compute_pool() noexcept {
+        // condition_variable_any wakes waiters on request_stop()
+        for (auto& thr: threads_)
+            thr.request_stop();
+        for (auto& thr: threads_) {
+            if (thr.joinable())
+                thr.join();
+        }
+    }
+
+    template <typename Fn>
+    struct [[nodiscard]] offload_awaitable : detail::compute_job
+    {
+        using result_type = std::invoke_result_t<Fn&>;
+
+        offload_awaitable(compute_pool* pool, Fn fn)
+            : pool_(pool), fn_(std::move(fn))
+        {
+            run = &offload_awaitable::execute;
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> coro) {
+            coro_ = coro;
+            owner_ = io_service::current();
+            pool_->enqueue(this);
+        }
+
+        result_type await_resume() {
+            if (exception_) [[unlikely]]
+                std::rethrow_exception(exception_);
+            if constexpr (!std::is_void_v<result_type>)
+                return std::move(*result_);
+        }
+
+    private:
+        static void execute(detail::compute_job* job) noexcept {
+            auto self = static_cast<offload_awaitable*>(job);
+            try {
+                if constexpr (std::is_void_v<result_type>)
+                    self->fn_();
+                else
+                    self->result_.emplace(self->fn_());
+            } catch (...) {
+                self->exception_ = std::current_exception();
+            }
+            // back to the ring the coroutine came from, its io is bound there
+            if (self->owner_ != nullptr)
+                self->owner_->post(self->coro_);
+            else
+                self->coro_.resume();
+        }
+
+        struct empty {};
+
+        compute_pool* pool_;
+        Fn fn_;
+        io_service* owner_{nullptr};
+        std::coroutine_handle<> coro_;
+        std::conditional_t<std::is_void_v<result_type>, empty, std::optional<result_type>> result_;
+        std::exception_ptr exception_;
+    };
+
+    /// run `fn()` on a compute thread, the awaiting coroutine resumes on its
+    /// original io_service thread with the result (or the exception thrown).
+    /// a coroutine not running on a ring continues on the compute thread.
+    template <typename Fn>
+    offload_awaitable<std::decay_t<Fn>> offload(Fn&& fn) {
+        return offload_awaitable<std::decay_t<Fn>>{this, std::forward<Fn>(fn)};
+    }
+
+    std::size_t size() const noexcept { return threads_.size(); }
+
+private:
+    void enqueue(detail::compute_job* job) {
+        {
+            std::lock_guard<std::mutex> g{mutex_};
+            job->next = nullptr;
+            if (tail_) tail_->next = job;
+            else head_ = job;
+            tail_ = job;
+        }
+        cv_.notify_one();
+    }
+
+    void work(std::stop_token st) {
+        for (;;) {
+            detail::compute_job* job;
+            {
+                std::unique_lock<std::mutex> lk{mutex_};
+                cv_.wait(lk, st, [&] { return head_ != nullptr; });
+                if (head_ == nullptr)
+                    return;
+                job = head_;
+                head_ = job->next;
+                if (head_ == nullptr) tail_ = nullptr;
+            }
+            job->run(job);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable_any cv_;
+    detail::compute_job* head_{nullptr};
+    detail::compute_job* tail_{nullptr};
+    std::vector<std::jthread> threads_;
+};
+
+
+/// process wide compute pool used by offload(), half of the hardware threads
+/// (at least one) so the io workers keep their cores.
+inline compute_pool& default_compute_pool() {
+    static compute_pool pool{std::max(1u, std::thread::hardware_concurrency() / 2)};
+    return pool;
+}
+
+/// co_await offload([&] { return compress(data); });
+template <typename Fn>
+auto offload(Fn&& fn) {
+    return default_compute_pool().offload(std::forward<Fn>(fn));
+}
+
+
+}
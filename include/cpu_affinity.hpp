@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <filesystem>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+namespace sheep {
+
+
+/// where the workers, their rings and their connections live.
+/// cpus are indexed by worker, worker i uses entry i % size(); empty vectors
+/// leave the scheduler in charge.
+struct cpu_placement
+{
+    // pin worker threads. the ring of a pinned worker is created on its cpu,
+    // so the kernel allocates it on that numa node, and workers on
+    // different nodes don't share an io-wq (IORING_SETUP_ATTACH_WQ)
+    std::vector<int> worker_cpus;
+    // pin the sqpoll thread of each worker's ring (io_service_options::sqpoll)
+    std::vector<int> sqpoll_cpus;
+    // hand every connection to the worker pinned on the cpu that processed
+    // its packets (SO_INCOMING_CPU), i.e. the cpu serving its nic queue
+    bool steer_incoming_cpu{false};
+
+    bool pinned() const noexcept { return !worker_cpus.empty(); }
+
+    int worker_cpu(std::size_t worker) const noexcept {
+        return worker_cpus.empty() ? -1 : worker_cpus[worker % worker_cpus.size()];
+    }
+
+    int sqpoll_cpu(std::size_t worker) const noexcept {
+        return sqpoll_cpus.empty() ? -1 : sqpoll_cpus[worker % sqpoll_cpus.size()];
+    }
+};
+
+
+/// pin the calling thread to `cpu`
+/// \return 0 on success, negative errno otherwise.
+inline int pin_this_thread(int cpu) noexcept {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return -::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+}
+
+/// numa node of `cpu` from sysfs, 0 when unknown (e.g. no numa support)
+inline int numa_node_of_cpu(int cpu) noexcept {
+    std::error_code ec;
+    auto dir = std::filesystem::path{"/sys/devices/system/cpu"} / ("cpu" + std::to_string(cpu));
+    for (auto& entry: std::filesystem::directory_iterator{dir, ec}) {
+        auto name = entry.path().filename().string();
+        int node = 0;
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0
+            && std::from_chars(name.data() + 4, name.data() + name.size(), node).ec == std::errc{})
+            return node;
+    }
+    return 0;
+}
+
+
+/// temporarily move the calling thread to `cpu`, so that memory the kernel
+/// allocates on its behalf (rings, registered buffers) lands on the local
+/// node. restores the previous affinity on destruction. no-op for cpu < 0.
+class scoped_affinity
+{
+public:
+    explicit scoped_affinity(int cpu) noexcept {
+        if (cpu < 0) return;
+        if (::pthread_getaffinity_np(::pthread_self(), sizeof(saved_), &saved_) != 0)
+            return;
+        active_ = pin_this_thread(cpu) == 0;
+    }
+
+    scoped_affinity(const scoped_affinity&) = delete;
+    scoped_affinity& operator=(const scoped_affinity&) = delete;
+
+    ~scoped_affinity() noexcept {
+        if (active_)
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(saved_), &saved_);
+    }
+
+private:
+    cpu_set_t saved_;
+    bool active_{false};
+};
+
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace sheep {
+
+
+/// counters of the calling thread's frame pool
+struct frame_pool_stats
+{
+    uint64_t hits{0};      // allocations served from a freelist
+    uint64_t misses{0};    // allocations that went to operator new
+    uint64_t oversized{0}; // frames above the largest size class, never cached
+    uint64_t released{0};  // frees handed to operator delete, the freelist was full
+};
+
+
+namespace detail {
+
+
+// 协程帧的线程局部内存池：按64字节划分size class，每个class一条空闲链表。
+// 释放时放回当前线程的链表（即使帧是在别的线程分配的，如acceptor线程
+// 创建、worker线程结束的session），链表满了才还给operator delete，
+// 所以线程间的不对称分配不会让某个线程的缓存无限增长。
+class frame_pool
+{
+public:
+    static constexpr std::size_t kGRANULE = 64;
+    static constexpr std::size_t kCLASSES = 32; // frames up to 2KB are pooled
+    static constexpr std::size_t kMAX_CACHED = 256; // blocks per size class
+
+    static void* allocate(std::size_t size) {
+        auto cls = size_class(size);
+        // frames created during thread exit must not touch the pool, it may
+        // be gone already
+        if (destroyed_) [[unlikely]]
+            return ::operator new(cls >= kCLASSES ? size : class_size(cls));
+        auto& pool = local();
+        if (cls >= kCLASSES) {
+            ++pool.stats_.oversized;
+            return ::operator new(size);
+        }
+        auto& list = pool.free_[cls];
+        if (list.head != nullptr) {
+            ++pool.stats_.hits;
+            auto block = list.head;
+            list.head = block->next;
+            --list.count;
+            return block;
+        }
+        ++pool.stats_.misses;
+        return ::operator new(class_size(cls));
+    }
+
+    static void deallocate(void* p, std::size_t size) noexcept {
+        auto cls = size_class(size);
+        if (cls >= kCLASSES || destroyed_) [[unlikely]] {
+            ::operator delete(p);
+            return;
+        }
+        auto& pool = local();
+        auto& list = pool.free_[cls];
+        if (list.count >= kMAX_CACHED) {
+            ++pool.stats_.released;
+            ::operator delete(p);
+            return;
+        }
+        auto block = static_cast<free_block*>(p);
+        block->next = list.head;
+        list.head = block;
+        ++list.count;
+    }
+
+    static const frame_pool_stats& stats() noexcept {
+        static const frame_pool_stats none{};
+        return destroyed_ ? none : local().stats_;
+    }
+
+    ~frame_pool() noexcept {
+        for (auto& list: free_) {
+            while (list.head != nullptr) {
+                auto block = list.head;
+                list.head = block->next;
+                ::operator delete(block);
+            }
+        }
+        // frames destroyed later during thread exit bypass the pool
+        destroyed_ = true;
+    }
+
+private:
+    struct free_block { free_block* next; };
+    struct free_list
+    {
+        free_block* head{nullptr};
+        std::size_t count{0};
+    };
+
+    static constexpr std::size_t size_class(std::size_t size) noexcept {
+        return (size + kGRANULE - 1) / kGRANULE - 1;
+    }
+
+    static constexpr std::size_t class_size(std::size_t cls) noexcept {
+        return (cls + 1) * kGRANULE;
+    }
+
+    static frame_pool& local() noexcept {
+        static thread_local frame_pool pool;
+        return pool;
+    }
+
+    std::array<free_list, kCLASSES> free_{};
+    frame_pool_stats stats_;
+    inline static thread_local bool destroyed_{false};
+};
+
+
+} // namespace detail
+
+
+/// hit/miss counters of the calling thread's coroutine frame pool
+inline const frame_pool_stats& frame_pool_stats_this_thread() noexcept {
+    return detail::frame_pool::stats();
+}
+
+
+}
@@ -1,74 +1,396 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <coroutine>
 #include <cstring>
 #include <deque>
 #include <iostream>
 #include <liburing.h>
 #include <liburing/io_uring.h>
+#include <linux/time_types.h>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <stop_token>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include <type_traits>
 #include <vector>
 
 #include "task.hpp"
+#include "provided_buffers.hpp"
+#include "timer_wheel.hpp"
 
 namespace sheep {
 
+class io_service;
+
 struct resume_handle {
 	int result{0}; // should largger than 0
+	unsigned flags{0}; // cqe flags, e.g. IORING_CQE_F_MORE
 	std::coroutine_handle<> coro;
+	// optional completion hook, for operations posting more than one cqe.
+	void (*on_complete)(resume_handle *, int, unsigned) noexcept {nullptr};
 
-	void resume(int res) noexcept {
+	void resume(int res, unsigned cqe_flags = 0) noexcept {
+		if (on_complete) {
+			on_complete(this, res, cqe_flags);
+			return;
+		}
 		result = res;
+		flags = cqe_flags;
 		coro.resume();
 	}
 };
 
+/// collects completions of a multishot operation (one sqe, many cqes).
+/// the kernel keeps posting cqes while IORING_CQE_F_MORE is set, results are
+/// queued here until the owning coroutine asks for the next one. once a cqe
+/// arrives without IORING_CQE_F_MORE the operation has to be re-armed.
+struct multishot_handle : resume_handle {
+	struct completion {
+		int result;
+		unsigned flags;
+	};
+
+	multishot_handle() noexcept { on_complete = &multishot_handle::push; }
+	multishot_handle(const multishot_handle &) = delete;
+	multishot_handle &operator=(const multishot_handle &) = delete;
+
+	bool armed() const noexcept { return armed_; }
+	void set_armed() noexcept { armed_ = true; }
+
+	/// hand every queued completion to fn and drop it
+	template <typename Fn> void drain(Fn &&fn) {
+		while (!pending_.empty()) {
+			fn(pending_.front());
+			pending_.pop_front();
+		}
+	}
+
+	// ring the operation was submitted to, set when it is abandoned
+	io_service *owner{nullptr};
+	// results are new fds (multishot accept), closed if nobody takes them
+	bool owns_fds{false};
+
+	struct [[nodiscard]] awaiter {
+		multishot_handle *handle_;
+
+		bool await_ready() const noexcept { return !handle_->pending_.empty(); }
+
+		void await_suspend(std::coroutine_handle<> coro_handle) noexcept {
+			handle_->coro = coro_handle;
+		}
+
+		completion await_resume() noexcept {
+			auto c = handle_->pending_.front();
+			handle_->pending_.pop_front();
+			return c;
+		}
+	};
+
+	/// wait for the next completion of the operation.
+	awaiter next() noexcept { return awaiter{this}; }
+
+private:
+	static void push(resume_handle *h, int res, unsigned cqe_flags) noexcept {
+		auto self = static_cast<multishot_handle *>(h);
+		if (!(cqe_flags & IORING_CQE_F_MORE))
+			self->armed_ = false;
+		self->pending_.push_back(completion{res, cqe_flags});
+		if (self->coro)
+			std::exchange(self->coro, nullptr).resume();
+	}
+
+	std::deque<completion> pending_;
+	bool armed_{false};
+};
+
+/// deferred work that runs once before the ring submits again, i.e. after
+/// the current batch of resumed coroutines. e.g. the writes a connection
+/// queued while handling several requests go out as one send.
+struct batch_hook {
+	void (*run)(batch_hook *) noexcept {nullptr};
+	batch_hook *next{nullptr};
+	bool queued{false};
+};
+
+/// an in-flight operation that io_service::cancel_group() may cancel, linked
+/// into its ring's list while the operation is pending. tracking is a list
+/// insert on the ring's thread, unlike a stop_callback per operation it
+/// touches no state shared with other threads.
+struct cancel_link {
+	cancel_link *prev{nullptr};
+	cancel_link *next{nullptr};
+	io_service *ios{nullptr}; // the ring tracking it, nullptr if none
+	uint64_t user_data{0};    // of the operation, see io_service::tag()
+	unsigned groups{0};       // bit mask
+
+	cancel_link() noexcept = default;
+	cancel_link(const cancel_link &) = delete;
+	cancel_link &operator=(const cancel_link &) = delete;
+	// unlinks, the owner (e.g. a coroutine frame) may go away first
+	~cancel_link() noexcept;
+
+	bool linked() const noexcept { return ios != nullptr; }
+};
+
+template <typename Rep, typename Period>
+constexpr __kernel_timespec duration_to_timespec(std::chrono::duration<Rep, Period> duration) {
+	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration);
+	duration -= seconds;
+	auto nanosecs = std::chrono::duration_cast<std::chrono::nanoseconds>(duration);
+	return __kernel_timespec{seconds.count(), nanosecs.count()};
+}
+
 struct [[nodiscard]] io_awaitable {
-	io_awaitable(io_uring_sqe *sqe) noexcept : sqe_(sqe) {}
+	io_awaitable(io_uring_sqe *sqe, io_service *ios = nullptr) noexcept
+		: sqe_(sqe), ios_(ios) {}
+
+	/// bound the operation with a linked timeout (IORING_OP_LINK_TIMEOUT),
+	/// when it expires first the operation completes with -ECANCELED.
+	/// must directly follow the call that created the operation.
+	template <typename Rep, typename Period>
+	io_awaitable &timeout_after(std::chrono::duration<Rep, Period> duration) noexcept {
+		link_timeout(duration_to_timespec(duration));
+		return *this;
+	}
+
+	/// cancel the operation (io_uring_prep_cancel) when a stop is requested
+	/// on `token`, it then completes with -ECANCELED. request_stop() may be
+	/// called from any thread.
+	io_awaitable &cancel_on(std::stop_token token) noexcept {
+		stop_ = std::move(token);
+		return *this;
+	}
+
+	/// cancel the operation when io_service::cancel_group() is called for one
+	/// of `groups` (a bit mask), before or while it is in flight. cheaper
+	/// than cancel_on() for io that is only cancelled in bulk, e.g. on shutdown.
+	io_awaitable &cancel_group(unsigned groups) noexcept {
+		groups_ |= groups;
+		return *this;
+	}
 
 	struct await_uring {
-		explicit await_uring(io_uring_sqe *sqe) : sqe_(sqe) {}
+		struct canceller {
+			await_uring *self;
+			void operator()() noexcept;
+		};
+
+		explicit await_uring(io_uring_sqe *sqe, io_service *ios, std::stop_token stop,
+							 unsigned groups)
+			: sqe_(sqe), ios_(ios), stop_(std::move(stop)) {
+			link_.groups = groups;
+		}
 		io_uring_sqe *sqe_;
+		io_service *ios_;
+		std::stop_token stop_;
+		cancel_link link_;
+		std::optional<std::stop_callback<canceller>> stop_callback_;
+		std::atomic<bool> cancel_posted_{false};
 		resume_handle resume_handler_;
+		// tagged, see io_service::tag()
+		uint64_t user_data_{0};
 
 		constexpr bool await_ready() const noexcept { return false; }
 
-		void await_suspend(std::coroutine_handle<> coro_handle) noexcept {
-			resume_handler_.coro = coro_handle;
-			io_uring_sqe_set_data(sqe_, &resume_handler_);
-		}
+		void await_suspend(std::coroutine_handle<> coro_handle) noexcept;
 
-		int await_resume() const noexcept { return resume_handler_.result; }
+		int await_resume() noexcept;
 	};
 
-	await_uring operator co_await() { return await_uring{sqe_}; }
+	await_uring operator co_await() { return await_uring{sqe_, ios_, std::move(stop_), groups_}; }
 
 	private:
+	void link_timeout(__kernel_timespec ts) noexcept;
+
 	io_uring_sqe *sqe_;
+	io_service *ios_;
+	std::stop_token stop_;
+	unsigned groups_{0};
+};
+
+/// state of a zero copy send. the first cqe carries the result, with
+/// IORING_CQE_F_MORE set a second one (IORING_CQE_F_NOTIF) follows once the
+/// kernel no longer reads the buffer. the coroutine resumes on the first cqe,
+/// the handle keeps the buffer owner alive and frees itself on the last one.
+struct zc_send_handle : resume_handle {
+	explicit zc_send_handle(std::shared_ptr<const void> buf_owner) noexcept
+		: owner(std::move(buf_owner)) {
+		on_complete = &zc_send_handle::on_cqe;
+	}
+
+	std::shared_ptr<const void> owner;
+	int *result_out{nullptr};
+
+private:
+	static void on_cqe(resume_handle *h, int res, unsigned cqe_flags) noexcept {
+		auto self = static_cast<zc_send_handle *>(h);
+		if (cqe_flags & IORING_CQE_F_NOTIF) {
+			delete self;
+			return;
+		}
+		if (self->result_out)
+			*self->result_out = res;
+		auto coro = std::exchange(self->coro, nullptr);
+		// no notification follows, e.g. the send failed
+		if (!(cqe_flags & IORING_CQE_F_MORE))
+			delete self;
+		if (coro)
+			coro.resume();
+	}
+};
+
+struct [[nodiscard]] zc_send_awaitable {
+	zc_send_awaitable(zc_send_handle *handle, io_uring_sqe *sqe, io_service *ios,
+					  uint64_t user_data) noexcept
+		: handle_(handle), sqe_(sqe), ios_(ios), user_data_(user_data) {}
+
+	/// see io_awaitable::timeout_after(), the send then completes with
+	/// -ECANCELED. the buffer owner is still released by the notification.
+	template <typename Rep, typename Period>
+	zc_send_awaitable &timeout_after(std::chrono::duration<Rep, Period> duration) noexcept {
+		link_timeout(duration_to_timespec(duration));
+		return *this;
+	}
+
+	/// see io_awaitable::cancel_group()
+	zc_send_awaitable &cancel_group(unsigned groups) noexcept {
+		groups_ |= groups;
+		return *this;
+	}
+
+	struct await_zc {
+		await_zc(zc_send_handle *handle, io_service *ios, uint64_t user_data,
+				 unsigned groups) noexcept
+			: handle_(handle), ios_(ios) {
+			link_.user_data = user_data;
+			link_.groups = groups;
+		}
+		zc_send_handle *handle_;
+		io_service *ios_;
+		cancel_link link_;
+		int result_{0};
+
+		constexpr bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> coro_handle) noexcept;
+
+		int await_resume() noexcept;
+	};
+
+	await_zc operator co_await() noexcept { return await_zc{handle_, ios_, user_data_, groups_}; }
+
+private:
+	void link_timeout(__kernel_timespec ts) noexcept;
+
+	zc_send_handle *handle_;
+	io_uring_sqe *sqe_;
+	io_service *ios_;
+	uint64_t user_data_;
+	unsigned groups_{0};
+};
+
+/// io_uring setup knobs of an io_service. flags unsupported by the running
+/// kernel are dropped one by one (newest first, sqpoll first if it lacks
+/// privileges) instead of failing the setup, each drop is logged.
+struct io_service_options {
+	unsigned entries{1024}; // io_service::kDEFAULT_URING_QUEUE_DEPTH
+	// completion queue size, 0 means 4 * entries. in-flight operations are
+	// bounded by the cq, not the sq, since sqes are recycled once submitted
+	unsigned cq_entries{0};
+	// kernel thread polls the sq, submission needs no io_uring_enter
+	bool sqpoll{false};
+	// idle time in milliseconds before the sq thread goes to sleep
+	unsigned sq_thread_idle{2000};
+	// pin the sq thread to this cpu, -1 lets the scheduler decide
+	int sq_thread_cpu{-1};
+	// don't interrupt the task to run completion work (5.19+)
+	bool coop_taskrun{false};
+	// only the thread driving the ring submits (6.0+)
+	bool single_issuer{false};
+	// run completion work only when the ring waits for events (6.1+),
+	// implies single_issuer. ignored together with sqpoll
+	bool defer_taskrun{false};
+	// buffers of the provided buffer ring (power of 2), 0 disables it (5.19+)
+	unsigned provided_buffers{0};
+	unsigned provided_buffer_size{4096};
+	int provided_buffer_group{0};
+	// slots of the registered file table, 0 disables it. files opt in, see
+	// io_service::register_file()
+	unsigned fixed_files{0};
+	// resolution of the timer wheel (sleep_for, deadline_timer)
+	std::chrono::nanoseconds timer_tick{std::chrono::milliseconds(1)};
+};
+
+/// counters of one io_service, only touched by the thread driving it.
+struct io_stats {
+	uint64_t submits{0};        // io_uring_enter calls that submitted sqes
+	uint64_t sqes_submitted{0};
+	uint64_t forced_submits{0}; // sq ran full in the middle of a batch
+	uint64_t cqes_reaped{0};
+	uint64_t cq_overflows{0};   // loop iterations that found the cq overflowed
+	uint64_t timers_fired{0};
+
+	double sqes_per_submit() const noexcept {
+		return submits ? static_cast<double>(sqes_submitted) / submits : 0.0;
+	}
 };
 
 class io_service {
 public:
-	static constexpr int kDEFAULT_URING_QUEUE_DEPTH = 64;
+	static constexpr int kDEFAULT_URING_QUEUE_DEPTH = 1024;
+	static constexpr unsigned kTAG_SHIFT = 48;
+	static constexpr uint64_t kHANDLE_MASK = (uint64_t{1} << kTAG_SHIFT) - 1;
+	static_assert(sizeof(void *) == sizeof(uint64_t), "user_data tags need 64 bit pointers");
 
 	io_service(int entries = kDEFAULT_URING_QUEUE_DEPTH, int uring_fd = -1)
 		: ring_(std::make_unique<struct io_uring>()) {}
 
 	~io_service() noexcept {
-		if (ring_.get())
+		if (ring_.get() && inited_)
 		io_uring_queue_exit(ring_.get());
+		if (wakeup_ && wakeup_->fd != -1)
+			::close(wakeup_->fd);
 	}
 
 	io_service(const io_service &) = delete;
 	io_service &operator=(const io_service &) = delete;
-	io_service(io_service &&other) noexcept : ring_(std::move(other.ring_)) {}
+	io_service(io_service &&other) noexcept
+		: ring_(std::move(other.ring_)), inited_(std::exchange(other.inited_, false))
+		, setup_flags_(other.setup_flags_), stats_(other.stats_), buffers_(std::move(other.buffers_))
+		, zc_send_supported_(other.zc_send_supported_)
+		, file_table_size_(std::exchange(other.file_table_size_, 0))
+		, free_slots_(std::move(other.free_slots_)), slot_of_fd_(std::move(other.slot_of_fd_))
+		, wakeup_(std::move(other.wakeup_))
+		, cancelled_groups_(other.cancelled_groups_), tracked_(std::exchange(other.tracked_, nullptr))
+		, timers_(std::move(other.timers_))
+		, timer_epoch_(other.timer_epoch_), timer_tick_(other.timer_tick_) {
+		if (wakeup_) wakeup_->ios = this;
+	}
 	io_service &operator=(io_service &&other) noexcept {
 		ring_ = std::move(other.ring_);
+		inited_ = std::exchange(other.inited_, false);
+		setup_flags_ = other.setup_flags_;
+		stats_ = other.stats_;
+		buffers_ = std::move(other.buffers_);
+		zc_send_supported_ = other.zc_send_supported_;
+		file_table_size_ = std::exchange(other.file_table_size_, 0);
+		free_slots_ = std::move(other.free_slots_);
+		slot_of_fd_ = std::move(other.slot_of_fd_);
+		wakeup_ = std::move(other.wakeup_);
+		if (wakeup_) wakeup_->ios = this;
+		timers_ = std::move(other.timers_);
+		timer_epoch_ = other.timer_epoch_;
+		timer_tick_ = other.timer_tick_;
+		cancelled_groups_ = other.cancelled_groups_;
+		tracked_ = std::exchange(other.tracked_, nullptr);
 		return *this;
 	}
 
@@ -76,85 +398,114 @@ public:
 
 	void init(int entries = kDEFAULT_URING_QUEUE_DEPTH,
 				int uring_fd = -1) noexcept {
-		struct io_uring_params param;
-		std::memset(&param, 0, sizeof(param));
-		if (uring_fd > 0) {
-			param.flags |= IORING_SETUP_ATTACH_WQ;
-			param.wq_fd = uring_fd;
-		}
+		io_service_options options;
+		options.entries = entries;
+		init(options, uring_fd);
+	}
+
+	void init(const io_service_options &options, int uring_fd = -1) noexcept {
+		unsigned flags = setup_flags(options);
+		unsigned features = 0;
+		int ret = 0;
+		for (;;) {
+			struct io_uring_params param;
+			std::memset(&param, 0, sizeof(param));
+			param.flags = flags;
+			if (uring_fd > 0) {
+				param.flags |= IORING_SETUP_ATTACH_WQ;
+				param.wq_fd = uring_fd;
+			}
+			param.flags |= IORING_SETUP_CQSIZE;
+			param.cq_entries = options.cq_entries ? options.cq_entries : 4 * options.entries;
+			if (flags & IORING_SETUP_SQPOLL) {
+				param.sq_thread_idle = options.sq_thread_idle;
+				if (options.sq_thread_cpu >= 0) {
+					param.flags |= IORING_SETUP_SQ_AFF;
+					param.sq_thread_cpu = options.sq_thread_cpu;
+				}
+			}
 
-		int ret = io_uring_queue_init_params(entries, ring_.get(), &param);
+			ret = io_uring_queue_init_params(options.entries, ring_.get(), &param);
+			features = param.features;
+			// older kernels reject unknown flags with EINVAL, sqpoll may need privileges
+			unsigned dropped = fallback_flag(flags, ret);
+			if (dropped != 0) {
+				std::cerr << "io_uring: setup failed with " << std::strerror(-ret)
+						  << ", retrying without " << flag_name(dropped) << std::endl;
+				flags &= ~dropped;
+				continue;
+			}
+			break;
+		}
 		if (ret < 0) {
-			std::cerr << "Failed to init io_uring, reason: " << std::strerror(errno);
+			std::cerr << "Failed to init io_uring, reason: " << std::strerror(-ret);
 			std::cerr << ". Abort!";
 			abort();
 		}
+		setup_flags_ = flags;
+		if (!(features & IORING_FEAT_NODROP))
+			std::cerr << "io_uring: kernel may drop completions when the cq is full, "
+					  << "see io_service::dropped_cqes()" << std::endl;
+
+		if (options.fixed_files > 0) {
+			ret = enable_file_table(options.fixed_files);
+			if (ret < 0)
+				std::cerr << "Failed to register file table, reason: "
+						  << std::strerror(-ret) << std::endl;
+		}
+
+		if (options.provided_buffers > 0) {
+			buffers_ = std::make_unique<provided_buffer_ring>();
+			ret = buffers_->setup(ring_.get(), options.provided_buffers,
+								  options.provided_buffer_size, options.provided_buffer_group);
+			if (ret < 0) {
+				// multishot recv is an opt-in, connections fall back to recv()
+				std::cerr << "Failed to register provided buffers, reason: "
+						  << std::strerror(-ret) << std::endl;
+				buffers_.reset();
+			}
+		}
+		inited_ = true;
+
+		// created up front, so notify() never races with the ring's thread.
+		// the read goes out with the ring's first submission
+		wakeup_ = std::make_unique<wakeup_channel>();
+		wakeup_->fd = ::eventfd(0, EFD_CLOEXEC);
+		wakeup_->ios = this;
+		wakeup_->on_complete = &io_service::on_wakeup;
+		arm_wakeup();
+
+		timer_tick_ = options.timer_tick.count() > 0 ? options.timer_tick
+													 : std::chrono::milliseconds(1);
+		timer_epoch_ = std::chrono::steady_clock::now();
+		timers_ = std::make_unique<timer_wheel>();
 	}
 
 public:
 	template <typename T> T run_task(task<T> &t) {
+		current_ = this;
 		t.resume();
 		while (!t.done()) 
 		{
-			io_uring_submit_and_wait(ring_.get(), /*completion numbers*/ 1);
-			int cqe_num = 0;
-			io_uring_cqe *cqe;
-			auto head{0};
-			io_uring_for_each_cqe(ring_.get(), head, cqe) {
-				++cqe_num;
-				// obtain user data: pointer to resume_handler
-				auto resume_handler =
-					static_cast<resume_handle *>(io_uring_cqe_get_data(cqe));
-				if (resume_handler)
-				resume_handler->resume(/*result code*/ cqe->res);
-			}
-			/*
-			* Must be called after io_uring_for_each_cqe()
-			*/
-			io_uring_cq_advance(ring_.get(), cqe_num);
+			run_once(/*completion numbers*/ 1);
 		}
 
 		return t.get_result();
 	}
 
-	void wait_io_and_resume_coroutine() {
-		io_uring_submit_and_wait(ring_.get(), 1);
-		int cqe_num = 0;
-		io_uring_cqe *cqe;
-		auto head{0};
-		io_uring_for_each_cqe(ring_.get(), head, cqe) 
-		{
-			++cqe_num;
-			auto resume_handler =
-				static_cast<resume_handle *>(io_uring_cqe_get_data(cqe));
-			if (resume_handler) {
-				resume_handler->resume(cqe->res);
-			}
-		}
-
-		io_uring_cq_advance(ring_.get(), cqe_num);
+	/// one event loop iteration: everything prepared while resuming the last
+	/// batch is submitted together with the wait, in a single syscall.
+	/// \param wait_nr completions to wait for, 0 polls without blocking.
+	void wait_io_and_resume_coroutine(unsigned wait_nr = 1) {
+		run_once(wait_nr);
 	}
 
 	void run_single_coro(std::coroutine_handle<> t) {
+		current_ = this;
 		t.resume();
 		while (!t.done()) 
 		{
-			io_uring_submit_and_wait(ring_.get(), /*completion numbers*/ 1);
-			int cqe_num = 0;
-			io_uring_cqe *cqe;
-			auto head{0};
-			io_uring_for_each_cqe(ring_.get(), head, cqe) {
-				++cqe_num;
-				// obtain user data: pointer to resume_handler
-				auto resume_handler =
-					static_cast<resume_handle *>(io_uring_cqe_get_data(cqe));
-				if (resume_handler)
-				resume_handler->resume(/*result code*/ cqe->res);
-			}
-			/*
-			* Must be called after io_uring_for_each_cqe()
-			*/
-			io_uring_cq_advance(ring_.get(), cqe_num);
+			run_once(/*completion numbers*/ 1);
 		}
 
 		return;
@@ -163,16 +514,15 @@ public:
 	template <typename Functor, typename... Args>
 	void wait_consume(Functor &fn, Args &&...args) {
 		// wait_nr = 0, in case there is no completion.
-		io_uring_submit_and_wait(ring_.get(), 0);
+		submit_and_wait(0);
 		int cqe_num = 0;
 		io_uring_cqe *cqe;
 		auto head{0};
 		io_uring_for_each_cqe(ring_.get(), head, cqe) 
 		{
 			++cqe_num;
-			auto resume_handler =
-				static_cast<resume_handle *>(io_uring_cqe_get_data(cqe));
-			if (resume_handler != nullptr) {
+			auto resume_handler = handle_of(cqe->user_data);
+			if (resume_handler != nullptr && cqe->user_data != LIBURING_UDATA_TIMEOUT) {
 				int res = cqe->res;
 				fn(resume_handler, res, std::forward<Args>(args)...);
 			}
@@ -180,21 +530,305 @@ public:
 		io_uring_cq_advance(ring_.get(), cqe_num);
 	}
 
+public: // registered (fixed) file table
+	/// register a sparse file table with `slots` entries. fds registered with
+	/// register_file() are then passed to the kernel by slot index
+	/// (IOSQE_FIXED_FILE), saving the fd table lookup and refcount per sqe.
+	/// \return 0 on success, negative errno otherwise.
+	int enable_file_table(unsigned slots) noexcept {
+		int ret = io_uring_register_files_sparse(ring_.get(), slots);
+		if (ret < 0)
+			return ret;
+		free_slots_.clear();
+		free_slots_.reserve(slots);
+		for (unsigned i = slots; i > 0; --i)
+			free_slots_.push_back(static_cast<int>(i - 1));
+		file_table_size_ = slots;
+		return 0;
+	}
+
+	bool has_file_table() const noexcept { return file_table_size_ > 0; }
+
+	/// take a free slot of the file table, -1 if it is full.
+	int alloc_file_slot() noexcept {
+		if (free_slots_.empty())
+			return -1;
+		int slot = free_slots_.back();
+		free_slots_.pop_back();
+		return slot;
+	}
+
+	void free_file_slot(unsigned slot) noexcept {
+		free_slots_.push_back(static_cast<int>(slot));
+	}
+
+	/// install fd into the file table, afterwards every operation on this
+	/// io_service uses the slot transparently. falls back to the plain fd
+	/// when there is no table or it is full. registering and unregistering
+	/// are a syscall each, which only pays off for long lived files; for
+	/// short lived sockets accept_direct() fills the slot without one.
+	/// \return the slot, or -1 if fd was not registered.
+	int register_file(int fd) noexcept {
+		if (!has_file_table() || fd < 0)
+			return -1;
+		if (registered_slot(fd) >= 0)
+			return registered_slot(fd);
+		int slot = alloc_file_slot();
+		if (slot < 0)
+			return -1;
+		if (io_uring_register_files_update(ring_.get(), slot, &fd, 1) < 0) {
+			free_file_slot(slot);
+			return -1;
+		}
+		if (static_cast<std::size_t>(fd) >= slot_of_fd_.size())
+			slot_of_fd_.resize(fd + 1, -1);
+		slot_of_fd_[fd] = slot;
+		return slot;
+	}
+
+	/// remove fd from the file table, must happen before the fd is closed.
+	void unregister_file(int fd) noexcept {
+		int slot = registered_slot(fd);
+		if (slot < 0)
+			return;
+		int empty = -1;
+		io_uring_register_files_update(ring_.get(), slot, &empty, 1);
+		slot_of_fd_[fd] = -1;
+		free_file_slot(slot);
+	}
+
+	/// slot of a registered fd, -1 if fd is not in the file table.
+	int registered_slot(int fd) const noexcept {
+		if (fd < 0 || static_cast<std::size_t>(fd) >= slot_of_fd_.size())
+			return -1;
+		return slot_of_fd_[fd];
+	}
+
+	/// provided buffer ring of this io_service, nullptr if not enabled.
+	provided_buffer_ring *buffer_ring() noexcept { return buffers_.get(); }
+
+	/// setup flags the ring was actually created with, after fallbacks.
+	unsigned setup_flags() const noexcept { return setup_flags_; }
+
+	/// a single issuer ring only accepts submissions from the thread that
+	/// enabled it, so it is created disabled and the thread driving it calls
+	/// this once before submitting. no-op for other rings.
+	void enable_on_this_thread() noexcept {
+		current_ = this;
+#ifdef IORING_SETUP_R_DISABLED
+		if (setup_flags_ & IORING_SETUP_R_DISABLED) {
+			io_uring_enable_rings(ring_.get());
+			setup_flags_ &= ~IORING_SETUP_R_DISABLED;
+		}
+#endif
+	}
+
+	/// wake the thread driving this ring, safe to call from any thread.
+	/// notifications are coalesced until the ring consumes the wakeup.
+	/// every ring keeps a read of its wakeup eventfd in flight from init()
+	/// on, so a thread blocked in io_uring_enter returns right away. an
+	/// eventfd (rather than IORING_OP_MSG_RING) is used because notifiers
+	/// need not own a ring.
+	void notify() noexcept {
+		if (!wakeup_->pending.exchange(true, std::memory_order_acq_rel)) {
+			uint64_t one = 1;
+			[[maybe_unused]] auto n = ::write(wakeup_->fd, &one, sizeof(one));
+		}
+	}
+
+	/// sqes are only handed to the kernel at the end of a loop iteration,
+	/// unless the sq fills up in between (counted as a forced submit).
+	/// one slot is kept spare, so that a linked timeout always lands right
+	/// behind its operation (see link_timeout_sqe()).
 	io_uring_sqe *get_sqe() noexcept {
+		if (io_uring_sq_space_left(ring_.get()) < 2) {
+			++stats_.forced_submits;
+			count_submit(io_uring_submit(ring_.get()));
+		}
 		auto *sqe = io_uring_get_sqe(ring_.get());
 		if (sqe == nullptr) {
-			io_uring_submit(ring_.get());
+			count_submit(io_uring_submit(ring_.get()));
 			sqe = io_uring_get_sqe(ring_.get());
 		}
 		return sqe;
 	}
 
+	/// link a timeout to the sqe just prepared by get_sqe(), the timespec is
+	/// owned by a handle that frees itself on the timeout's completion.
+	void link_timeout_sqe(io_uring_sqe *sqe, __kernel_timespec ts) noexcept {
+		auto *timeout_sqe = io_uring_get_sqe(ring_.get());
+		if (timeout_sqe == nullptr) [[unlikely]]
+			return;
+		sqe->flags |= IOSQE_IO_LINK;
+		auto handle = new link_timeout_handle{ts};
+		io_uring_prep_link_timeout(timeout_sqe, &handle->ts, 0);
+		io_uring_sqe_set_data(timeout_sqe, handle);
+	}
+
+	/// ask the ring to cancel the operation submitted with `user_data`, safe
+	/// to call from any thread. the cancel sqe is issued by the thread
+	/// driving the ring.
+	void post_cancel(uint64_t user_data) {
+		{
+			std::lock_guard<std::mutex> g{cancel_mutex_};
+			cancel_requests_.push_back(user_data);
+		}
+		has_cancel_requests_.store(true, std::memory_order_release);
+		notify();
+	}
+
+	/// cancel an operation submitted with the plain address of `handle`, e.g.
+	/// a multishot operation whose handle outlives its final completion
+	void post_cancel(resume_handle *handle) { post_cancel(reinterpret_cast<uint64_t>(handle)); }
+
+	/// drop a cancel request whose operation already completed
+	void forget_cancel(uint64_t user_data) {
+		std::lock_guard<std::mutex> g{cancel_mutex_};
+		std::erase(cancel_requests_, user_data);
+	}
+
+public: // cancel groups
+	/// cancel every in-flight operation tracked in one of `groups` (a bit
+	/// mask), and every one tracked from now on. safe to call from any
+	/// thread, the ring's thread walks its own list. e.g. Server cancels the
+	/// receives of all connections to drain them.
+	void cancel_group(unsigned groups) {
+		requested_groups_.fetch_or(groups, std::memory_order_acq_rel);
+		has_cancel_requests_.store(true, std::memory_order_release);
+		notify();
+	}
+
+	/// the groups cancelled so far, as seen by the ring's thread
+	unsigned cancelled_groups() const noexcept { return cancelled_groups_; }
+
+	/// link an in-flight operation, it is cancelled right away if one of its
+	/// groups already is. must be called on the thread driving the ring.
+	void track(cancel_link &link) noexcept {
+		link.ios = this;
+		link.prev = nullptr;
+		link.next = tracked_;
+		if (tracked_ != nullptr)
+			tracked_->prev = &link;
+		tracked_ = &link;
+		if (link.groups & cancelled_groups_)
+			prep_cancel(link.user_data);
+	}
+
+	/// unlink an operation once it completed
+	void untrack(cancel_link &link) noexcept {
+		if (link.prev != nullptr)
+			link.prev->next = link.next;
+		else
+			tracked_ = link.next;
+		if (link.next != nullptr)
+			link.next->prev = link.prev;
+		link.prev = link.next = nullptr;
+		link.ios = nullptr;
+	}
+
+	/// user_data of an operation completing to `handle`: its address in the
+	/// low 48 bits (the user half of the address space) and a generation in
+	/// the high 16. a handle living in a coroutine frame may sit at the
+	/// address of one that just completed (the frame pool is lifo); a cancel
+	/// prepared for the old operation then doesn't match the new one.
+	uint64_t tag(resume_handle *handle) noexcept {
+		return reinterpret_cast<uint64_t>(handle) | (uint64_t{++generation_} << kTAG_SHIFT);
+	}
+
+	static resume_handle *handle_of(uint64_t user_data) noexcept {
+		return reinterpret_cast<resume_handle *>(user_data & kHANDLE_MASK);
+	}
+
+	const io_stats &stats() const noexcept { return stats_; }
+
+	/// cqes the kernel had to drop because the cq was full, only possible
+	/// on kernels without IORING_FEAT_NODROP.
+	unsigned dropped_cqes() const noexcept { return *ring_->cq.koverflow; }
+
+	/// the io_service driven by the calling thread, nullptr on other threads
+	static io_service *current() noexcept { return current_; }
+
+	/// resume `coro` on the thread driving this ring, after the completions
+	/// of the current loop iteration. safe to call from any thread.
+	void post(std::coroutine_handle<> coro) {
+		{
+			std::lock_guard<std::mutex> g{post_mutex_};
+			posted_.push_back(coro);
+		}
+		has_posted_.store(true, std::memory_order_release);
+		// the ring's own thread drains the list before it blocks again
+		if (current_ != this)
+			notify();
+	}
+
+	/// run `hook` once before the ring next submits. queueing a queued
+	/// hook is a no-op. must be called on the thread driving the ring.
+	void at_batch_end(batch_hook &hook) noexcept {
+		if (hook.queued)
+			return;
+		hook.queued = true;
+		hook.next = batch_hooks_;
+		batch_hooks_ = &hook;
+	}
+
+	/// unqueue a hook whose owner goes away before it ran
+	void cancel_batch_hook(batch_hook &hook) noexcept {
+		if (!hook.queued)
+			return;
+		for (auto link = &batch_hooks_; *link != nullptr; link = &(*link)->next) {
+			if (*link == &hook) {
+				*link = hook.next;
+				break;
+			}
+		}
+		hook.queued = false;
+		hook.next = nullptr;
+	}
+
+public: // timers
+	using clock = std::chrono::steady_clock;
+
+	/// the timer wheel of this ring. every loop iteration sleeps at most
+	/// until the wheel's next event (a single timeout of the wait, no sqe
+	/// per timer) and then expires the due timers.
+	timer_wheel &timers() noexcept { return *timers_; }
+
+	/// first tick at or after `when`, a timer never fires early
+	uint64_t to_tick(clock::time_point when) const noexcept {
+		auto elapsed = when - timer_epoch_;
+		if (elapsed.count() <= 0)
+			return 0;
+		return static_cast<uint64_t>((elapsed + timer_tick_ - clock::duration{1}) / timer_tick_);
+	}
+
+	/// the tick the clock is in now
+	uint64_t current_tick() const noexcept {
+		return static_cast<uint64_t>((clock::now() - timer_epoch_) / timer_tick_);
+	}
+
+	clock::time_point tick_time(uint64_t tick) const noexcept {
+		return timer_epoch_ + std::chrono::duration_cast<clock::duration>(
+								  timer_tick_ * static_cast<int64_t>(tick));
+	}
+
+	/// arm (or move) `node` to expire at `when`, O(1)
+	void arm_timer(timer_node &node, clock::time_point when) noexcept {
+		// an idle wheel lags behind the clock, catch up before arming.
+		// nothing is due on an empty wheel, no callback runs
+		if (timers_->empty())
+			timers_->advance(current_tick());
+		timers_->arm(node, to_tick(when));
+	}
+
+	/// disarm `node`, O(1)
+	void cancel_timer(timer_node &node) noexcept { timers_->cancel(node); }
+
 
 public: // syscalls / io interfaces
 	io_awaitable nop() noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_nop(sqe);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit read operation
@@ -205,7 +839,8 @@ public: // syscalls / io interfaces
 	io_awaitable read(int fd, void *buf, unsigned nbytes, off_t offset) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_read(sqe, fd, buf, nbytes, offset);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit "scatter" read operation
@@ -217,7 +852,8 @@ public: // syscalls / io interfaces
 						off_t offset) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_readv(sqe, fd, iovecs, nr_vecs, offset);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit read operation, read data to
@@ -231,7 +867,8 @@ public: // syscalls / io interfaces
 							int buf_index) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit write operation
@@ -243,7 +880,8 @@ public: // syscalls / io interfaces
 						off_t offset) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_write(sqe, fd, buf, nbytes, offset);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit "gather" write operation
@@ -255,7 +893,8 @@ public: // syscalls / io interfaces
 						off_t offset) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_writev(sqe, fd, iovecs, nr_vecs, offset);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit write operation, write data to fixed
@@ -269,7 +908,8 @@ public: // syscalls / io interfaces
 							off_t offset, int buf_index) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_index);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit fsync operation, flush/sync buffers of file's data and metadata to
@@ -278,15 +918,17 @@ public: // syscalls / io interfaces
 	io_awaitable fsync(int fd, unsigned fsync_flags) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_fsync(sqe, fd, fsync_flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit close operation
 	/// \param fd the file descriptor to close.
 	io_awaitable close(int fd) noexcept {
+		unregister_file(fd);
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_close(sqe, fd);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit openat operation, open file in a path
@@ -300,7 +942,7 @@ public: // syscalls / io interfaces
 						mode_t mode) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_openat(sqe, dfd, path, flags, mode);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit statx operation, the statx syscall gets meta information of a file.
@@ -315,7 +957,7 @@ public: // syscalls / io interfaces
 						struct statx *statxbuf) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_statx(sqe, dfd, path, flags, mask, statxbuf);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 	/// submit splice operation, the splice syscall copies data
@@ -329,7 +971,7 @@ public: // syscalls / io interfaces
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_splice(sqe, fd_in, off_in, fd_out, off_out, nbytes,
 							splice_flags);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 	/// read data from a socket
@@ -339,7 +981,8 @@ public: // syscalls / io interfaces
 	io_awaitable recvmsg(int fd, struct msghdr *msg, unsigned flags) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_recvmsg(sqe, fd, msg, flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// same as recvmsg, but for writing to a socket.
@@ -347,7 +990,21 @@ public: // syscalls / io interfaces
 						unsigned flags) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_sendmsg(sqe, fd, msg, flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
+	}
+
+	/// sendmsg whose completion goes to the on_complete hook of `handle`
+	/// rather than to an awaiting coroutine, for writes nobody waits for.
+	/// \return the sqe, e.g. to link a timeout to it. its user_data is
+	/// tagged (see tag()), to track or cancel the operation by.
+	io_uring_sqe *sendmsg(int fd, const struct msghdr *msg, unsigned flags,
+						  resume_handle &handle) noexcept {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_sendmsg(sqe, fd, msg, flags);
+		use_registered_file(sqe, fd);
+		io_uring_sqe_set_data64(sqe, tag(&handle));
+		return sqe;
 	}
 
 	/// read data from a socket, works with both tcp and udp sockets.
@@ -358,7 +1015,8 @@ public: // syscalls / io interfaces
 	io_awaitable recv(int sockfd, void *buf, size_t len, int flags) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_recv(sqe, sockfd, buf, len, flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, sockfd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// same ad recv, but for writing to a socket.
@@ -366,9 +1024,32 @@ public: // syscalls / io interfaces
 						int flags) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_send(sqe, sockfd, buf, len, flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, sockfd);
+		return io_awaitable{sqe, this};
 	}
 
+	/// zero copy send (6.0+), the kernel reads the pages of buf directly.
+	/// completes with the bytes sent, `owner` is kept alive until the kernel
+	/// releases the buffer, which may be after the coroutine has resumed.
+	/// -EINVAL/-EOPNOTSUPP means the kernel or socket can't do zero copy.
+	/// \param sockfd the socket to write to.
+	/// \param owner keeps buf alive, may be null if buf outlives the socket.
+	zc_send_awaitable send_zc(int sockfd, const void *buf, size_t len, int flags,
+							  std::shared_ptr<const void> owner) {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_send_zc(sqe, sockfd, buf, len, flags, 0);
+		use_registered_file(sqe, sockfd);
+		auto handle = new zc_send_handle(std::move(owner));
+		auto user_data = tag(handle);
+		io_uring_sqe_set_data64(sqe, user_data);
+		return zc_send_awaitable{handle, sqe, this, user_data};
+	}
+
+	/// cleared after the kernel rejected a zero copy send, callers then stick
+	/// to copying sends on this ring.
+	bool zc_send_supported() const noexcept { return zc_send_supported_; }
+	void set_zc_send_unsupported() noexcept { zc_send_supported_ = false; }
+
 	/// accept connection-oriented(TCP) socket.
 	/// \param fd the listening socket.
 	/// \param addr pointer to the listening address.
@@ -378,7 +1059,80 @@ public: // syscalls / io interfaces
 						int flags = 0) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_accept(sqe, fd, addr, addrlen, flags);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
+	}
+
+	/// accept connections with a single multishot sqe, every accepted
+	/// client fd is posted as a separate completion to the handle.
+	/// \param fd the listening socket.
+	/// \param handle collects the accepted fds, must outlive the operation.
+	/// \param flags bit mask applied to the accepted sockets, e.g. SOCK_CLOEXEC.
+	void multishot_accept(int fd, multishot_handle &handle, int flags = 0) noexcept {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_multishot_accept(sqe, fd, nullptr, nullptr, flags);
+		use_registered_file(sqe, fd);
+		io_uring_sqe_set_data(sqe, &handle);
+		handle.owns_fds = true;
+		handle.set_armed();
+	}
+
+	/// receive with a single multishot sqe, the kernel picks a buffer from the
+	/// provided buffer ring for every completion (IORING_CQE_F_BUFFER).
+	/// \param sockfd the socket to read from.
+	/// \param handle collects the completions, must outlive the operation.
+	/// \param flags bit mask influences the read.
+	void recv_multishot(int sockfd, multishot_handle &handle, int flags = 0) noexcept {
+		assert(buffers_ != nullptr);
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_recv_multishot(sqe, sockfd, nullptr, 0, flags);
+		use_registered_file(sqe, sockfd);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = buffers_->group_id();
+		io_uring_sqe_set_data(sqe, &handle);
+		handle.set_armed();
+	}
+
+	/// the owner of a multishot operation goes away: cancel the operation,
+	/// the handle frees itself once the kernel posts the final completion.
+	/// buffers picked for queued or late completions go back to the ring,
+	/// fds accepted by them are closed.
+	void abandon(std::unique_ptr<multishot_handle> handle) noexcept {
+		handle->drain([this, &handle](const multishot_handle::completion &c) {
+			discard(*handle, c.result, c.flags);
+		});
+		if (!handle->armed())
+			return;
+
+		auto h = handle.release();
+		h->owner = this;
+		h->on_complete = &io_service::on_abandoned;
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_cancel(sqe, h, 0);
+		io_uring_sqe_set_data(sqe, nullptr);
+	}
+
+	/// accept a connection into a slot of the file table (direct descriptor),
+	/// no regular fd is created. the cqe result is 0 on success.
+	/// \param fd the listening socket.
+	/// \param slot free slot of the file table, see alloc_file_slot().
+	io_awaitable accept_direct(int fd, sockaddr *addr, socklen_t *addrlen,
+							   unsigned slot, int flags = 0) noexcept {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_accept_direct(sqe, fd, addr, addrlen, flags, slot);
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
+	}
+
+	/// release a direct descriptor: close the file and free its slot. the
+	/// slot is only handed out again once the close completed, before that
+	/// it still holds the file.
+	task<int> close_direct(unsigned slot) {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_close_direct(sqe, slot);
+		int ret = co_await io_awaitable{sqe, this};
+		free_file_slot(slot);
+		co_return ret;
 	}
 
 	/// connect the socket.
@@ -388,7 +1142,8 @@ public: // syscalls / io interfaces
 	io_awaitable connect(int fd, sockaddr *addr, socklen_t addrlen) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_connect(sqe, fd, addr, addrlen);
-		return io_awaitable{sqe};
+		use_registered_file(sqe, fd);
+		return io_awaitable{sqe, this};
 	}
 
 	/// wait for specified duration asynchronously
@@ -397,11 +1152,334 @@ public: // syscalls / io interfaces
 						unsigned flags = 0) noexcept {
 		io_uring_sqe *sqe = get_sqe();
 		io_uring_prep_timeout(sqe, ts, count, flags);
-		return io_awaitable{sqe};
+		return io_awaitable{sqe, this};
 	}
 
 private:
+	static unsigned setup_flags(const io_service_options &options) noexcept {
+		unsigned flags = 0;
+		if (options.sqpoll)
+			flags |= IORING_SETUP_SQPOLL;
+		// the kernel refuses the combination, no point in asking
+		bool defer_taskrun = options.defer_taskrun;
+		if (defer_taskrun && options.sqpoll) {
+			std::cerr << "io_uring: defer_taskrun doesn't work with sqpoll, ignored" << std::endl;
+			defer_taskrun = false;
+		}
+#ifdef IORING_SETUP_COOP_TASKRUN
+		if (options.coop_taskrun)
+			flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+#endif
+#ifdef IORING_SETUP_SINGLE_ISSUER
+		if (options.single_issuer || defer_taskrun)
+			flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED;
+#endif
+#ifdef IORING_SETUP_DEFER_TASKRUN
+		if (defer_taskrun)
+			flags |= IORING_SETUP_DEFER_TASKRUN;
+#endif
+		return flags;
+	}
+
+	/// the flag(s) to retry without after the setup failed with `err`, 0 to
+	/// give up. EPERM is about sqpoll's privileges, so it goes first; on
+	/// EINVAL the newest flag goes first: defer_taskrun, single_issuer,
+	/// coop_taskrun, sqpoll.
+	static unsigned fallback_flag(unsigned flags, int err) noexcept {
+		if (err == -EPERM)
+			return flags & IORING_SETUP_SQPOLL;
+		if (err != -EINVAL)
+			return 0;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+		if (flags & IORING_SETUP_DEFER_TASKRUN)
+			return IORING_SETUP_DEFER_TASKRUN;
+#endif
+#ifdef IORING_SETUP_SINGLE_ISSUER
+		if (flags & IORING_SETUP_SINGLE_ISSUER)
+			return IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED;
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+		if (flags & IORING_SETUP_COOP_TASKRUN)
+			return IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+#endif
+		return flags & IORING_SETUP_SQPOLL;
+	}
+
+	static const char *flag_name(unsigned flag) noexcept {
+		if (flag & IORING_SETUP_SQPOLL)
+			return "sqpoll";
+#ifdef IORING_SETUP_DEFER_TASKRUN
+		if (flag & IORING_SETUP_DEFER_TASKRUN)
+			return "defer_taskrun";
+#endif
+#ifdef IORING_SETUP_SINGLE_ISSUER
+		if (flag & IORING_SETUP_SINGLE_ISSUER)
+			return "single_issuer";
+#endif
+		return "coop_taskrun";
+	}
+
+	void count_submit(int submitted) noexcept {
+		if (submitted > 0) {
+			++stats_.submits;
+			stats_.sqes_submitted += submitted;
+		}
+	}
+
+	void issue_cancels() noexcept {
+		if (!has_cancel_requests_.exchange(false, std::memory_order_acq_rel))
+			return;
+		std::vector<uint64_t> requests;
+		{
+			std::lock_guard<std::mutex> g{cancel_mutex_};
+			requests.swap(cancel_requests_);
+		}
+		for (auto user_data : requests)
+			prep_cancel(user_data);
+
+		unsigned groups = requested_groups_.exchange(0, std::memory_order_acq_rel);
+		if (groups == 0)
+			return;
+		cancelled_groups_ |= groups;
+		for (auto link = tracked_; link != nullptr; link = link->next) {
+			if (link->groups & groups)
+				prep_cancel(link->user_data);
+		}
+	}
+
+	void prep_cancel(uint64_t user_data) noexcept {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_cancel64(sqe, user_data, 0);
+		io_uring_sqe_set_data(sqe, nullptr);
+	}
+
+	void submit_and_wait(unsigned wait_nr) noexcept {
+		issue_cancels();
+		// completions that didn't fit into the cq wait in the kernel's overflow
+		// list (IORING_FEAT_NODROP), entering with GETEVENTS flushes them
+		if (io_uring_cq_has_overflow(ring_.get()))
+			++stats_.cq_overflows;
+		auto next = timers_ ? timers_->next_event() : 0;
+		if (wait_nr == 0 || next == 0) {
+			count_submit(io_uring_submit_and_wait(ring_.get(), wait_nr));
+			return;
+		}
+		// sleep no longer than until the next timer event
+		auto remaining = tick_time(next) - clock::now();
+		if (remaining.count() <= 0) {
+			count_submit(io_uring_submit_and_wait(ring_.get(), 0));
+			return;
+		}
+		auto ts = duration_to_timespec(remaining);
+		io_uring_cqe *cqe = nullptr;
+		// returns the result of the wait rather than the sqes submitted, they
+		// went in unless the submission itself failed. -ETIME: the deadline
+		// passed without completions
+		unsigned ready = io_uring_sq_ready(ring_.get());
+		int ret = io_uring_submit_and_wait_timeout(ring_.get(), &cqe, wait_nr, &ts, nullptr);
+		if (ret >= 0 || ret == -ETIME || ret == -EINTR)
+			count_submit(static_cast<int>(ready));
+	}
+
+	void expire_timers() noexcept {
+		if (!timers_ || timers_->empty())
+			return;
+		stats_.timers_fired += timers_->advance(current_tick());
+	}
+
+	void resume_posted() {
+		if (!has_posted_.exchange(false, std::memory_order_acq_rel))
+			return;
+		std::vector<std::coroutine_handle<>> batch;
+		{
+			std::lock_guard<std::mutex> g{post_mutex_};
+			batch.swap(posted_);
+		}
+		for (auto coro : batch)
+			coro.resume();
+	}
+
+	void run_batch_hooks() noexcept {
+		// popped one by one: a hook may queue or cancel others
+		while (batch_hooks_ != nullptr) {
+			auto hook = batch_hooks_;
+			batch_hooks_ = std::exchange(hook->next, nullptr);
+			hook->queued = false;
+			hook->run(hook);
+		}
+	}
+
+	void run_once(unsigned wait_nr) noexcept {
+		// the batch resumed since the last call is over
+		run_batch_hooks();
+		// don't block while posted coroutines are runnable
+		if (has_posted_.load(std::memory_order_acquire))
+			wait_nr = 0;
+		submit_and_wait(wait_nr);
+		reap_completions();
+		expire_timers();
+		resume_posted();
+	}
+
+	/// resume the owners of all ready cqes, then release them in one go
+	unsigned reap_completions() noexcept {
+		unsigned cqe_num = 0;
+		unsigned head;
+		io_uring_cqe *cqe;
+		io_uring_for_each_cqe(ring_.get(), head, cqe) {
+			++cqe_num;
+			// obtain user data: pointer to resume_handler, see tag()
+			auto resume_handler = handle_of(cqe->user_data);
+			// LIBURING_UDATA_TIMEOUT: internal timeout of a wait with a deadline
+			if (resume_handler && cqe->user_data != LIBURING_UDATA_TIMEOUT)
+				resume_handler->resume(/*result code*/ cqe->res, cqe->flags);
+		}
+		/*
+		* Must be called after io_uring_for_each_cqe()
+		*/
+		io_uring_cq_advance(ring_.get(), cqe_num);
+		stats_.cqes_reaped += cqe_num;
+		return cqe_num;
+	}
+
+	/// point the sqe at the file table slot of fd, if it is registered
+	void use_registered_file(io_uring_sqe *sqe, int fd) const noexcept {
+		int slot = registered_slot(fd);
+		if (slot >= 0) {
+			sqe->fd = slot;
+			sqe->flags |= IOSQE_FIXED_FILE;
+		}
+	}
+
+	/// drop a completion nobody will consume
+	void discard(multishot_handle &handle, int res, unsigned cqe_flags) noexcept {
+		if (buffers_)
+			buffers_->recycle_cqe(cqe_flags);
+		if (handle.owns_fds && res >= 0)
+			::close(res);
+	}
+
+	static void on_abandoned(resume_handle *h, int res, unsigned cqe_flags) noexcept {
+		auto handle = static_cast<multishot_handle *>(h);
+		handle->owner->discard(*handle, res, cqe_flags);
+		if (!(cqe_flags & IORING_CQE_F_MORE))
+			delete handle;
+	}
+
+	struct wakeup_channel : resume_handle {
+		int fd{-1};
+		uint64_t value{0};
+		io_service *ios{nullptr};
+		std::atomic<bool> pending{false};
+	};
+
+	void arm_wakeup() noexcept {
+		io_uring_sqe *sqe = get_sqe();
+		io_uring_prep_read(sqe, wakeup_->fd, &wakeup_->value, sizeof(wakeup_->value), 0);
+		io_uring_sqe_set_data(sqe, wakeup_.get());
+	}
+
+	static void on_wakeup(resume_handle *h, int, unsigned) noexcept {
+		auto channel = static_cast<wakeup_channel *>(h);
+		// clear before the caller drains its queues, later notifies write again
+		channel->pending.store(false, std::memory_order_release);
+		channel->ios->arm_wakeup();
+		channel->ios->issue_cancels();
+	}
+
+	struct link_timeout_handle : resume_handle {
+		explicit link_timeout_handle(__kernel_timespec t) noexcept : ts(t) {
+			on_complete = &link_timeout_handle::on_cqe;
+		}
+		// read by the kernel when the sqe is consumed, even with sqpoll
+		__kernel_timespec ts;
+
+		static void on_cqe(resume_handle *h, int, unsigned) noexcept {
+			delete static_cast<link_timeout_handle *>(h);
+		}
+	};
+
   	std::unique_ptr<io_uring> ring_;
+	bool inited_{false};
+	unsigned setup_flags_{0};
+	io_stats stats_;
+	std::unique_ptr<provided_buffer_ring> buffers_;
+	bool zc_send_supported_{true};
+	unsigned file_table_size_{0};
+	std::vector<int> free_slots_;
+	std::vector<int> slot_of_fd_; // fd -> file table slot, -1 if none
+	std::unique_ptr<wakeup_channel> wakeup_;
+	std::mutex cancel_mutex_;
+	std::vector<uint64_t> cancel_requests_;
+	uint16_t generation_{0};
+	std::atomic<unsigned> requested_groups_{0};
+	unsigned cancelled_groups_{0};
+	cancel_link *tracked_{nullptr};
+	std::atomic<bool> has_cancel_requests_{false};
+	std::mutex post_mutex_;
+	std::vector<std::coroutine_handle<>> posted_;
+	std::atomic<bool> has_posted_{false};
+	inline static thread_local io_service *current_{nullptr};
+	std::unique_ptr<timer_wheel> timers_;
+	std::chrono::steady_clock::time_point timer_epoch_;
+	std::chrono::nanoseconds timer_tick_{std::chrono::milliseconds(1)};
+	batch_hook *batch_hooks_{nullptr};
 };
 
+inline void io_awaitable::link_timeout(__kernel_timespec ts) noexcept {
+	assert(ios_ != nullptr);
+	ios_->link_timeout_sqe(sqe_, ts);
+}
+
+inline void zc_send_awaitable::link_timeout(__kernel_timespec ts) noexcept {
+	ios_->link_timeout_sqe(sqe_, ts);
+}
+
+inline void zc_send_awaitable::await_zc::await_suspend(std::coroutine_handle<> coro_handle) noexcept {
+	handle_->coro = coro_handle;
+	handle_->result_out = &result_;
+	if (link_.groups != 0)
+		ios_->track(link_);
+}
+
+inline int zc_send_awaitable::await_zc::await_resume() noexcept {
+	if (link_.linked())
+		ios_->untrack(link_);
+	return result_;
+}
+
+inline cancel_link::~cancel_link() noexcept {
+	if (ios != nullptr)
+		ios->untrack(*this);
+}
+
+inline void io_awaitable::await_uring::await_suspend(std::coroutine_handle<> coro_handle) noexcept {
+	resume_handler_.coro = coro_handle;
+	user_data_ = ios_ != nullptr ? ios_->tag(&resume_handler_)
+								 : reinterpret_cast<uint64_t>(&resume_handler_);
+	io_uring_sqe_set_data64(sqe_, user_data_);
+	if (link_.groups != 0 && ios_ != nullptr) {
+		link_.user_data = user_data_;
+		ios_->track(link_);
+	}
+	if (stop_.stop_possible() && ios_ != nullptr)
+		// fires right away if a stop was already requested
+		stop_callback_.emplace(stop_, canceller{this});
+}
+
+inline void io_awaitable::await_uring::canceller::operator()() noexcept {
+	self->cancel_posted_.store(true, std::memory_order_relaxed);
+	self->ios_->post_cancel(self->user_data_);
+}
+
+inline int io_awaitable::await_uring::await_resume() noexcept {
+	if (link_.linked())
+		ios_->untrack(link_);
+	// waits for a callback running on another thread
+	stop_callback_.reset();
+	if (cancel_posted_.load(std::memory_order_relaxed))
+		ios_->forget_cancel(user_data_);
+	return resume_handler_.result;
+}
+
 } // namespace sheep
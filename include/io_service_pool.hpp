@@ -1,7 +1,9 @@
 #pragma once
 
+#include <map>
 #include <vector>
 
+#include "cpu_affinity.hpp"
 #include "io_service.hpp"
 #include "types.hpp"
 
@@ -11,14 +13,28 @@ namespace sheep {
 class io_service_pool
 {
 public:
-    explicit io_service_pool(std::size_t init_size) noexcept
+    /// \param placement with pinned workers every ring is created on its
+    /// worker's cpu (node local memory) and only rings on the same numa node
+    /// share an io-wq.
+    explicit io_service_pool(std::size_t init_size, const io_service_options& options = {},
+                             const cpu_placement& placement = {}) noexcept
     {
         pool_.reserve(init_size);
-        pool_.emplace_back(io_service());
-        pool_[0].init(io_service::kDEFAULT_URING_QUEUE_DEPTH);
-        for (auto i=1; i!=init_size; ++i) {
+        // numa node -> ring whose io-wq the other rings of the node attach to
+        std::map<int, int> wq_of_node;
+        for (std::size_t i=0; i!=init_size; ++i) {
+            auto ring_options = options;
+            if (placement.sqpoll_cpu(i) >= 0)
+                ring_options.sq_thread_cpu = placement.sqpoll_cpu(i);
+            int cpu = placement.worker_cpu(i);
+            int node = cpu >= 0 ? numa_node_of_cpu(cpu) : 0;
+            auto wq = wq_of_node.find(node);
+
+            scoped_affinity on_worker_cpu{cpu};
             pool_.emplace_back(io_service());
-            pool_[i].init(io_service::kDEFAULT_URING_QUEUE_DEPTH, pool_[0].get_uring_fd());
+            pool_[i].init(ring_options, wq != wq_of_node.end() ? wq->second : -1);
+            if (wq == wq_of_node.end())
+                wq_of_node.emplace(node, pool_[i].get_uring_fd());
         }
     }
 
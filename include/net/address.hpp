@@ -95,7 +95,7 @@ public:
     }
 
 private:
-    Protocol protocol_;
+    Protocol protocol_{Protocol::Ipv4};
     struct sockaddr addr_;
     socklen_t addr_len_;
 };
@@ -1,83 +1,739 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <limits>
 #include <memory>
 #include <coroutine>
+#include <cerrno>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
 
+#include "admission.hpp"
 #include "buffer.hpp"
+#include "chained_buffer.hpp"
+#include "slab_pool.hpp"
 #include "io_service.hpp"
+#include "timeout.hpp"
+#include "net/framing.hpp"
 #include "net/socket.hpp"
 
 namespace sheep {
 
 
+namespace detail {
+
+
+// 连接的输出队列：write()只把数据追加到链式缓冲区，并在io_service上登记一个
+// batch_hook。本轮被恢复的协程都执行完后（ring下一次提交之前），队列中的数据
+// 用一个sendmsg发出，多个小的响应合并成一个sqe和尽量少的TCP报文。
+// 发送中的sendmsg引用队列的内存，所以队列单独分配在堆上。连接销毁时队列里
+// 还有数据（或者发送未完成）的话，队列接管socket，数据发完（或出错）后关闭
+// socket并自行释放。
+struct output_stream : resume_handle, batch_hook
+{
+    chained_buffer data;
+    std::array<iovec, chained_buffer::kMAX_IOVECS> iov;
+    msghdr msg{};
+    io_service* ios{nullptr};
+    int fd{-1};
+    int error{0};          // sticky, reported by the next flush()
+    bool sending{false};   // a sendmsg is in flight
+    bool orphaned{false};  // the connection is gone, owns the fd now
+    std::coroutine_handle<> waiter; // flush() waiting for the queue to drain
+    // the connection's send cancel groups and deadline apply to the sendmsg
+    cancel_link link;
+    std::chrono::milliseconds timeout{0};
+    // bytes went out, e.g. pushes back the connection's idle deadline
+    void (*on_progress)(void*) noexcept {nullptr};
+    void* owner{nullptr};
+
+    output_stream() noexcept {
+        on_complete = &output_stream::on_sent;
+        run = &output_stream::on_batch_end;
+    }
+
+    /// send the queued bytes at the end of the current batch
+    void schedule() noexcept {
+        if (!sending && ios != nullptr)
+            ios->at_batch_end(*this);
+    }
+
+    /// \return false if there was nothing (left) to send
+    bool start() noexcept {
+        if (sending) return true;
+        if (data.empty() || error != 0) return false;
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = data.data_iovecs(iov);
+        auto sqe = ios->sendmsg(fd, &msg, MSG_NOSIGNAL, *this);
+        if (timeout.count() > 0)
+            ios->link_timeout_sqe(sqe, duration_to_timespec(timeout));
+        if (link.groups != 0) {
+            link.user_data = sqe->user_data;
+            ios->track(link);
+        }
+        sending = true;
+        return true;
+    }
+
+    static void on_batch_end(batch_hook* hook) noexcept {
+        static_cast<output_stream*>(hook)->start();
+    }
+
+    static void on_sent(resume_handle* handle, int res, unsigned) noexcept {
+        auto self = static_cast<output_stream*>(handle);
+        self->sending = false;
+        if (self->link.linked())
+            self->link.ios->untrack(self->link);
+        if (res > 0) {
+            self->data.consume(res);
+            if (self->on_progress) self->on_progress(self->owner);
+        } else {
+            self->error = res < 0 ? res : -EPIPE;
+        }
+        if (self->orphaned) {
+            // the rest goes out before the socket is closed
+            if (!self->start()) self->retire();
+            return;
+        }
+        // bytes queued meanwhile go out right away, flush() waits for them
+        if (!self->start() && self->waiter)
+            std::exchange(self->waiter, nullptr).resume();
+    }
+
+    /// take over the socket of a connection going away: the queued bytes are
+    /// still sent, the socket is closed and the stream freed afterwards.
+    /// \return false if there is nothing to send, the caller closes the fd.
+    bool orphan() noexcept {
+        if (ios == nullptr || !start())
+            return false;
+        // the admission ticket goes away with the connection
+        data.set_account(nullptr, nullptr);
+        on_progress = nullptr;
+        owner = nullptr;
+        orphaned = true;
+        return true;
+    }
+
+    void retire() noexcept {
+        ios->unregister_file(fd);
+        ::close(fd);
+        delete this;
+    }
+};
+
+
+} // namespace detail
+
+
 namespace net {
 
 
 class Connection
 {
 public:
+    // below this size copying into the kernel is cheaper than pinning pages
+    static constexpr std::size_t kDEFAULT_ZC_THRESHOLD = 16 * 1024;
+    // recv_until() gives up on lines longer than this by default
+    static constexpr std::size_t kDEFAULT_MAX_UNTIL = 64 * 1024;
+    // a larger copy of a frame spanning segments is freed after use
+    static constexpr std::size_t kMAX_KEPT_FRAME_COPY = 64 * 1024;
+
+    // buffers are allocated on first use, i.e. by the worker serving the
+    // connection rather than the acceptor, so they come from its local node
     explicit Connection(std::unique_ptr<Socket> conn_socket)
         : sock_(std::move(conn_socket))
-        , read_buf_(std::make_unique<Buffer>())
-        , write_buf_(std::make_unique<Buffer>())
     {
-
+        input_.set_account(&Connection::on_segments, this);
     }
 
     Connection(const Connection&) = delete;
     Connection& operator=(const Connection&) = delete;
 
+    // created by the acceptor, destroyed by a worker: the memory goes back
+    // to the acceptor's slab to be reused for the next connection
+    static void* operator new(std::size_t size) { return detail::slab_new<Connection>(size); }
+    static void operator delete(void* p, std::size_t size) noexcept { detail::slab_delete<Connection>(p, size); }
+
     Connection(Connection&& other) noexcept 
         : sock_(std::move(other.sock_))
+        , addr_(other.addr_)
+        , addr_resolved_(other.addr_resolved_)
         , read_buf_(std::move(other.read_buf_))
         , write_buf_(std::move(other.write_buf_))
         , ios_(other.ios_)
-    {}
+        , use_file_table_(std::exchange(other.use_file_table_, false))
+        , recv_stream_(std::move(other.recv_stream_))
+        , zc_threshold_(other.zc_threshold_)
+        , io_timeout_(other.io_timeout_)
+        , recv_groups_(other.recv_groups_)
+        , send_groups_(other.send_groups_)
+        , idle_timeout_(other.idle_timeout_)
+        , admission_(std::move(other.admission_))
+        , input_(std::move(other.input_))
+        , output_(std::move(other.output_))
+        , codec_(other.codec_)
+        , frame_size_(std::exchange(other.frame_size_, 0))
+        , frame_copy_(std::move(other.frame_copy_))
+    {
+        // the timer points back at `other`, re-armed on the next io
+        other.idle_timer_.reset();
+        // the ticket came along with the charges for the segments
+        input_.rebind_account(this);
+        if (output_) {
+            output_->owner = this;
+            output_->data.rebind_account(this);
+        }
+    }
 
     ~Connection() noexcept {
-        ::close(get_fd());
+        // the multishot recv must not outlive its handle
+        if (recv_stream_ && ios_ != nullptr)
+            ios_->abandon(std::move(recv_stream_));
+        int fd = sock_->release();
+        if (output_) {
+            if (output_->queued && ios_ != nullptr)
+                ios_->cancel_batch_hook(*output_);
+            // bytes written before the handler returned are sent rather than
+            // dropped, the stream closes the socket when it is done
+            if (output_->orphan()) {
+                output_.release();
+                return;
+            }
+        }
+        if (ios_ != nullptr && use_file_table_)
+            ios_->unregister_file(fd);
+        ::close(fd);
     }
 
     void set_client_addr(const net::Address& addr) noexcept {
         addr_ = addr;
+        addr_resolved_ = true;
+    }
+
+    /// peer address, resolved lazily so that accepting stays cheap.
+    const net::Address& client_addr() noexcept {
+        if (!addr_resolved_) {
+            ::getpeername(get_fd(), addr_.sockaddr(), addr_.len());
+            addr_resolved_ = true;
+        }
+        return addr_;
     }
-    const net::Address& client_addr() const noexcept { return addr_; }
 
     int get_fd() const noexcept { return sock_->fd(); }
 
     Socket* get_socket() noexcept { return sock_.get(); }
 
-    Buffer* read_buf() noexcept { return read_buf_.get(); }
+    Buffer* read_buf() {
+        if (!read_buf_) {
+            read_buf_ = std::make_unique<Buffer>();
+            admission_.charge(read_buf_->capacity());
+        }
+        return read_buf_.get();
+    }
+
+    Buffer* write_buf() {
+        if (!write_buf_) {
+            write_buf_ = std::make_unique<Buffer>();
+            admission_.charge(write_buf_->capacity());
+        }
+        return write_buf_.get();
+    }
+
+    /// the connection's slot in the server's budget, released when the
+    /// connection is destroyed. its buffers, the segments of its input and
+    /// output queues and the copies of frames spanning segments are charged
+    /// to it.
+    void set_admission(admission_ticket ticket) noexcept {
+        admission_ = std::move(ticket);
+        if (read_buf_) admission_.charge(read_buf_->capacity());
+        if (write_buf_) admission_.charge(write_buf_->capacity());
+        admission_.charge(input_.segments() * detail::segment_pool::kBLOCK_SIZE);
+        if (output_)
+            admission_.charge(output_->data.segments() * detail::segment_pool::kBLOCK_SIZE);
+        admission_.charge(frame_copy_.capacity());
+    }
+
+    /// the worker serving the connection, its admission slot moves along
+    void set_worker(int worker) noexcept { admission_.move_to(worker); }
 
-    Buffer* write_buf() noexcept { return write_buf_.get(); }
+    /// bind the connection to the ring serving it
+    void set_io_service(io_service* ios) noexcept {
+        if (ios_ == ios) return;
+        idle_timer_.reset();
+        if (ios_ != nullptr && use_file_table_)
+            ios_->unregister_file(get_fd());
+        ios_ = ios;
+        if (ios_ != nullptr && use_file_table_)
+            ios_->register_file(get_fd());
+        if (output_)
+            output_->ios = ios_;
+    }
 
-    void set_io_service(io_service* ios) noexcept { ios_ = ios; }
+    /// install the socket in the file table of its ring (if it has one, see
+    /// io_service_options::fixed_files), so its operations skip the fd
+    /// lookup. it costs a register syscall now and one on close, worth it
+    /// for long lived connections only. stays on when the ring changes.
+    void use_file_table() noexcept {
+        if (use_file_table_) return;
+        use_file_table_ = true;
+        if (ios_ != nullptr)
+            ios_->register_file(get_fd());
+    }
     io_service* get_io_service() noexcept { return ios_; }
 
+    /// deadline of every recv()/send(), enforced by a linked timeout.
+    /// an expired operation returns -ECANCELED. zero disables it.
+    void set_io_timeout(std::chrono::milliseconds timeout) noexcept {
+        io_timeout_ = timeout;
+        if (output_) output_->timeout = timeout;
+    }
+
+    /// pending and later receives return -ECANCELED once one of
+    /// `recv_groups` is cancelled on the connection's ring (see
+    /// io_service::cancel_group()), sends once one of `send_groups` is.
+    /// e.g. Server cancels the receives to drain: a connection waiting for
+    /// its next request is closed, one in the middle of a response gets to
+    /// finish it. the ring tracks the operations, there is no per operation
+    /// stop_callback on a state shared by all connections.
+    void set_cancel_groups(unsigned recv_groups, unsigned send_groups) noexcept {
+        recv_groups_ = recv_groups;
+        send_groups_ = send_groups;
+        if (output_) output_->link.groups = send_groups;
+    }
+
+    /// shut the socket down after `timeout` without recv()/send() calls, a
+    /// pending recv then returns 0. the deadline lives on the ring's timer
+    /// wheel and is pushed back in O(1) by every call. zero disables it.
+    void set_idle_timeout(std::chrono::milliseconds timeout) noexcept {
+        idle_timeout_ = timeout;
+        if (idle_timeout_.count() == 0)
+            idle_timer_.reset();
+        else
+            touch();
+    }
+
     task<int> recv() {
         assert(ios_ != nullptr);
-        read_buf_->clear();
-        int bytes_read = co_await ios_->recv(get_fd(), (void*)read_buf_->data(), read_buf_->capacity(), 0);
-        read_buf_->set_size(bytes_read);
+        touch();
+        // no clearing, the size set below is all that marks the contents
+        auto buf = read_buf();
+        int bytes_read = co_await bounded(
+            ios_->recv(get_fd(), (void*)buf->data(), buf->capacity(), 0), recv_groups_);
+        buf->set_size(bytes_read > 0 ? bytes_read : 0);
         co_return bytes_read;
     }
 
+    /// receive through the io_service's provided buffer ring, opt-in via
+    /// io_service_options::provided_buffers. a multishot recv stays armed
+    /// across calls, so idle connections commit no read memory and calls
+    /// cost no sqe while data keeps arriving. the returned buffer goes back
+    /// to the ring when destroyed, don't hold on to it longer than needed.
+    task<provided_buffer> recv_provided() {
+        assert(ios_ != nullptr && ios_->buffer_ring() != nullptr);
+        touch();
+        if (!recv_stream_)
+            recv_stream_ = std::make_unique<multishot_handle>();
+        if (ios_->cancelled_groups() & recv_groups_)
+            co_return provided_buffer{ios_->buffer_ring(), -ECANCELED, 0};
+        if (!recv_stream_->armed())
+            ios_->recv_multishot(get_fd(), *recv_stream_);
+
+        // a cancelled stream posts its final cqe with -ECANCELED
+        cancel_link link;
+        if (recv_groups_ != 0) {
+            link.user_data = reinterpret_cast<uint64_t>(recv_stream_.get());
+            link.groups = recv_groups_;
+            ios_->track(link);
+        }
+        auto [res, flags] = co_await recv_stream_->next();
+        co_return provided_buffer{ios_->buffer_ring(), res, flags};
+    }
+
     task<int> send() {
         assert(ios_ != nullptr);
-        int bytes_sent = co_await
+        touch();
+        int bytes_sent = co_await bounded(
             ios_->send(
-                get_fd(), (void*)write_buf_->data(), write_buf_->size(), 0);
+                get_fd(), (void*)write_buf()->data(), write_buf()->size(), 0));
+
+        co_return bytes_sent;
+    }
+
+    /// receive into the spare capacity of `buf`, which first grows by whole
+    /// segments to hold at least `min_spare` bytes: one recvmsg sqe, the data
+    /// lands in place and nothing is truncated.
+    /// \return bytes received, 0 on eof, negative errno on error.
+    task<int> recv_into(chained_buffer& buf, std::size_t min_spare = chained_buffer::kSEGMENT_SIZE) {
+        return recv_chain(buf, min_spare, false);
+    }
+
+    /// bytes received by recv_exact(n), recv_until() and read_frame() and
+    /// not consumed yet. the last frame read stays in front until the next
+    /// read.
+    chained_buffer& input() noexcept { return input_; }
+
+    /// wait until input() holds at least `n` bytes, without copying them out.
+    /// the missing bytes are asked for with MSG_WAITALL, usually one sqe.
+    /// \return n, 0 on eof before that, negative errno on error.
+    task<int> recv_exact(std::size_t n) {
+        drop_frame();
+        while (input_.size() < n) {
+            int bytes_read = co_await recv_chain(input_, n - input_.size(), true);
+            if (bytes_read <= 0)
+                co_return bytes_read;
+        }
+        co_return static_cast<int>(n);
+    }
+
+    /// fill `out` completely, taking buffered input() first and receiving
+    /// the rest straight into `out` with MSG_WAITALL.
+    /// \return out.size(), 0 on eof before that, negative errno on error.
+    task<int> recv_exact(std::span<std::byte> out) {
+        drop_frame();
+        auto got = input_.peek(out.data(), out.size());
+        input_.consume(got);
+        while (got < out.size()) {
+            int bytes_read = co_await bounded(
+                ios_->recv(get_fd(), out.data() + got, out.size() - got, MSG_WAITALL), recv_groups_);
+            if (bytes_read <= 0)
+                co_return bytes_read;
+            got += bytes_read;
+        }
+        co_return static_cast<int>(got);
+    }
+
+    /// receive until `delim` shows up in input(), where the data stays.
+    /// \return length of the bytes up to and including the delimiter, 0 on
+    /// eof, -EMSGSIZE if `max_size` bytes arrived without one, negative errno
+    /// on error.
+    task<int> recv_until(std::string_view delim, std::size_t max_size = kDEFAULT_MAX_UNTIL) {
+        drop_frame();
+        std::size_t from = 0;
+        for (;;) {
+            auto pos = input_.find(delim, from);
+            if (pos != chained_buffer::npos)
+                co_return static_cast<int>(pos + delim.size());
+            if (input_.size() >= max_size)
+                co_return -EMSGSIZE;
+            // a delimiter may straddle the bytes scanned and the next ones
+            from = input_.size() >= delim.size() ? input_.size() - delim.size() + 1 : 0;
+            int bytes_read = co_await recv_chain(input_, 1, false);
+            if (bytes_read <= 0)
+                co_return bytes_read;
+        }
+    }
+
+    /// the codec read_frame() uses, it must outlive the connection's reads.
+    /// codecs keep no per connection state, one may serve many connections
+    void set_codec(codec_ref codec) noexcept { codec_ = codec; }
+
+    /// the next frame of the codec set by set_codec()
+    task<frame> read_frame() {
+        assert(codec_);
+        return read_frame(codec_);
+    }
+
+    /// the next frame of `codec`. frames already in input() are returned
+    /// without any io, a recv takes in as many as fit in the spare capacity,
+    /// and large payloads are waited for with MSG_WAITALL. the frame views
+    /// the segment it arrived in, one spanning segments is copied to a
+    /// buffer the connection reuses; either way it is valid until the next
+    /// read.
+    /// \return frame.status: its size, 0 on eof, -EMSGSIZE for a frame
+    /// over the codec's limit, negative errno otherwise.
+    template <frame_codec Codec>
+    task<frame> read_frame(Codec& codec) {
+        drop_frame();
+        frame_layout layout;
+        for (;;) {
+            int need = codec.parse(input_, layout);
+            if (need < 0)
+                co_return frame::end(need);
+            std::size_t want = need == 0 ? layout.total() : static_cast<std::size_t>(need);
+            if (want > static_cast<std::size_t>(std::numeric_limits<int>::max()))
+                co_return frame::end(-EMSGSIZE);
+            if (need == 0 && input_.size() >= want)
+                break;
+            auto missing = want > input_.size() ? want - input_.size() : 1;
+            bool exact = missing > chained_buffer::kSEGMENT_SIZE;
+            int bytes_read = co_await recv_chain(
+                input_, exact ? missing : chained_buffer::kSEGMENT_SIZE, exact);
+            if (bytes_read <= 0)
+                co_return frame::end(bytes_read);
+        }
 
+        frame_size_ = layout.total();
+        auto front = input_.front();
+        const std::byte* bytes = front.data();
+        if (front.size() < frame_size_) {
+            auto capacity = frame_copy_.capacity();
+            frame_copy_.resize(frame_size_);
+            admission_.charge(frame_copy_.capacity() - capacity);
+            input_.peek(frame_copy_.data(), frame_size_);
+            bytes = frame_copy_.data();
+        }
+        co_return frame{static_cast<int>(frame_size_), {bytes, frame_size_}, layout};
+    }
+
+    /// send the bytes of `buf` with one sendmsg sqe (up to kMAX_IOVECS
+    /// segments) and consume what was sent, the send may be partial.
+    /// \return bytes sent, negative errno on error.
+    task<int> send_from(chained_buffer& buf) {
+        assert(ios_ != nullptr);
+        touch();
+        std::array<iovec, chained_buffer::kMAX_IOVECS> iov;
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = buf.data_iovecs(iov);
+        if (msg.msg_iovlen == 0)
+            co_return 0;
+        int bytes_sent = co_await bounded(ios_->sendmsg(get_fd(), &msg, MSG_NOSIGNAL));
+        if (bytes_sent > 0)
+            buf.consume(bytes_sent);
         co_return bytes_sent;
     }
 
+    /// send all of `data`, resubmitting after short writes (socket buffer
+    /// full, signals). MSG_WAITALL lets the kernel retry within one sqe.
+    /// \return data.size(), negative errno on error.
+    task<int> send_all(std::span<const std::byte> data) {
+        assert(ios_ != nullptr);
+        std::size_t sent = 0;
+        while (sent < data.size()) {
+            touch();
+            int bytes_sent = co_await bounded(ios_->send(
+                get_fd(), data.data() + sent, data.size() - sent, MSG_WAITALL | MSG_NOSIGNAL));
+            if (bytes_sent < 0)
+                co_return bytes_sent;
+            if (bytes_sent == 0)
+                co_return -EPIPE;
+            sent += bytes_sent;
+        }
+        co_return static_cast<int>(sent);
+    }
+
+    /// send_all() of the write buffer
+    task<int> send_all() {
+        auto buf = write_buf();
+        co_return co_await send_all(std::span{reinterpret_cast<const std::byte*>(buf->data()), buf->size()});
+    }
+
+    /// send and consume everything in `buf`
+    /// \return bytes sent, negative errno on error.
+    task<int> send_all(chained_buffer& buf) {
+        std::size_t sent = 0;
+        while (!buf.empty()) {
+            int bytes_sent = co_await send_from(buf);
+            if (bytes_sent < 0)
+                co_return bytes_sent;
+            if (bytes_sent == 0)
+                co_return -EPIPE;
+            sent += bytes_sent;
+        }
+        co_return static_cast<int>(sent);
+    }
+
+    /// queue bytes for sending without any io. everything written during
+    /// the current batch of resumed coroutines is sent with one sendmsg
+    /// before the ring submits again, or earlier by flush(). don't mix with
+    /// the direct sends while bytes are queued, they would be reordered.
+    void write(const void* data, std::size_t n) {
+        auto& out = output();
+        out.data.append(data, n);
+        out.schedule();
+    }
+
+    void write(std::string_view s) { write(s.data(), s.size()); }
+
+    /// queue the bytes of `chain` without copying them
+    void write(chained_buffer&& chain) {
+        auto& out = output();
+        out.data.append(std::move(chain));
+        out.schedule();
+    }
+
+    /// queued bytes not acknowledged by a send completion yet
+    std::size_t pending_output() const noexcept { return output_ ? output_->data.size() : 0; }
+
+    /// send the queued bytes now and wait until all of them went out. the
+    /// sends are bounded like send(): the io timeout, the send cancel groups
+    /// and the idle timeout, which every partial send pushes back.
+    /// \return 0, or the negative errno of the send that failed; the bytes
+    /// queued behind it are kept.
+    task<int> flush() {
+        assert(ios_ != nullptr);
+        auto& out = output();
+        touch();
+        if (out.start()) {
+            struct awaiter
+            {
+                detail::output_stream& out_;
+
+                bool await_ready() const noexcept { return !out_.sending; }
+                void await_suspend(std::coroutine_handle<> coro) noexcept { out_.waiter = coro; }
+                void await_resume() const noexcept {}
+            };
+            co_await awaiter{out};
+        }
+        co_return std::exchange(out.error, 0);
+    }
+
+    void set_zc_threshold(std::size_t bytes) noexcept { zc_threshold_ = bytes; }
+    std::size_t zc_threshold() const noexcept { return zc_threshold_; }
+
+    /// send data without copying it into the kernel (IORING_OP_SEND_ZC).
+    /// `owner` keeps data alive until the kernel releases the pages, which
+    /// can be after this returns. falls back to a copying send below
+    /// zc_threshold() or when the kernel does not support zero copy. bounded
+    /// like send() by the io timeout and the send cancel groups.
+    task<int> send_zc(std::span<const std::byte> data, std::shared_ptr<const void> owner) {
+        assert(ios_ != nullptr);
+        touch();
+        if (data.size() >= zc_threshold_ && ios_->zc_send_supported()) {
+            // a send failing without notification frees the handle and its
+            // reference, the fallback below still reads data
+            auto keep = owner;
+            int bytes_sent = co_await bounded(
+                ios_->send_zc(get_fd(), data.data(), data.size(), 0, std::move(owner)));
+            if (bytes_sent != -EINVAL && bytes_sent != -EOPNOTSUPP)
+                co_return bytes_sent;
+            ios_->set_zc_send_unsupported();
+            owner = std::move(keep);
+        }
+        co_return co_await bounded(ios_->send(get_fd(), data.data(), data.size(), 0));
+    }
+
+    /// zero copy variant of send(): the write buffer is handed over to the
+    /// kernel and the connection continues with a fresh one of equal capacity.
+    task<int> send_zc() {
+        assert(ios_ != nullptr);
+        if (write_buf()->size() < zc_threshold_ || !ios_->zc_send_supported())
+            co_return co_await send();
+
+        std::shared_ptr<Buffer> in_flight = std::exchange(
+            write_buf_, std::make_unique<Buffer>(write_buf_->capacity()));
+        std::span<const std::byte> data{
+            reinterpret_cast<const std::byte*>(in_flight->data()), in_flight->size()};
+        co_return co_await send_zc(data, std::move(in_flight));
+    }
+
 
 private:
+    /// push back the idle deadline
+    void touch() noexcept {
+        if (idle_timeout_.count() == 0 || ios_ == nullptr)
+            return;
+        if (!idle_timer_)
+            idle_timer_ = std::make_unique<deadline_timer>(*ios_, &Connection::on_idle, this);
+        idle_timer_->expires_after(idle_timeout_);
+    }
+
+    static void on_segments(void* ctx, std::ptrdiff_t bytes) noexcept {
+        auto& ticket = static_cast<Connection*>(ctx)->admission_;
+        if (bytes > 0)
+            ticket.charge(static_cast<std::size_t>(bytes));
+        else
+            ticket.uncharge(static_cast<std::size_t>(-bytes));
+    }
+
+    static void on_output_progress(void* ctx) noexcept {
+        static_cast<Connection*>(ctx)->touch();
+    }
+
+    static void on_idle(void* ctx) noexcept {
+        ::shutdown(static_cast<Connection*>(ctx)->get_fd(), SHUT_RDWR);
+    }
+
+    /// release the frame handed out last. one large frame must not pin its
+    /// copy for the rest of the connection
+    void drop_frame() noexcept {
+        input_.consume(std::exchange(frame_size_, 0));
+        if (frame_copy_.capacity() > kMAX_KEPT_FRAME_COPY) {
+            admission_.uncharge(frame_copy_.capacity());
+            std::vector<std::byte>{}.swap(frame_copy_);
+        }
+    }
+
+    /// receive into the spare capacity of `buf`. with `exact` the iovecs are
+    /// cut at `min_spare` bytes and MSG_WAITALL waits until all arrived.
+    task<int> recv_chain(chained_buffer& buf, std::size_t min_spare, bool exact) {
+        assert(ios_ != nullptr);
+        touch();
+        std::array<iovec, chained_buffer::kMAX_IOVECS> iov;
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = buf.prepare(iov, min_spare);
+        if (exact) {
+            std::size_t left = min_spare;
+            for (std::size_t i=0; i<msg.msg_iovlen; ++i) {
+                iov[i].iov_len = std::min(iov[i].iov_len, left);
+                left -= iov[i].iov_len;
+                if (left == 0) {
+                    msg.msg_iovlen = i + 1;
+                    break;
+                }
+            }
+        }
+        int bytes_read = co_await bounded(
+            ios_->recvmsg(get_fd(), &msg, exact ? MSG_WAITALL : 0), recv_groups_);
+        if (bytes_read > 0)
+            buf.commit(bytes_read);
+        co_return bytes_read;
+    }
+
+    detail::output_stream& output() {
+        if (!output_) {
+            output_ = std::make_unique<detail::output_stream>();
+            output_->ios = ios_;
+            output_->fd = get_fd();
+            output_->link.groups = send_groups_;
+            output_->timeout = io_timeout_;
+            output_->on_progress = &Connection::on_output_progress;
+            output_->owner = this;
+            output_->data.set_account(&Connection::on_segments, this);
+        }
+        return *output_;
+    }
+
+    /// attach the connection's deadline and cancel groups to an operation,
+    /// an io_awaitable or a zc_send_awaitable
+    template <typename Awaitable>
+    Awaitable bounded(Awaitable op) {
+        return bounded(std::move(op), send_groups_);
+    }
+
+    template <typename Awaitable>
+    Awaitable bounded(Awaitable op, unsigned groups) {
+        if (io_timeout_.count() > 0)
+            op.timeout_after(io_timeout_);
+        if (groups != 0)
+            op.cancel_group(groups);
+        return op;
+    }
+
     std::unique_ptr<Socket> sock_;
     net::Address addr_;
+    bool addr_resolved_{false};
     std::unique_ptr<Buffer> read_buf_;
     std::unique_ptr<Buffer> write_buf_;
     io_service* ios_{nullptr};
+    bool use_file_table_{false};
+    std::unique_ptr<multishot_handle> recv_stream_;
+    std::size_t zc_threshold_{kDEFAULT_ZC_THRESHOLD};
+    std::chrono::milliseconds io_timeout_{0};
+    unsigned recv_groups_{0};
+    unsigned send_groups_{0};
+    std::chrono::milliseconds idle_timeout_{0};
+    std::unique_ptr<deadline_timer> idle_timer_;
+    admission_ticket admission_;
+    chained_buffer input_;
+    std::unique_ptr<detail::output_stream> output_;
+    codec_ref codec_;
+    std::size_t frame_size_{0};          // bytes of the last frame, still in input_
+    std::vector<std::byte> frame_copy_;  // frames spanning segments
 };
 
 } // namespace net
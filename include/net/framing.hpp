@@ -0,0 +1,276 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "chained_buffer.hpp"
+
+namespace sheep {
+
+namespace net {
+
+
+// 消息分帧：codec只负责从接收缓冲区的开头解析出一帧的布局（头部、负载和尾部
+// 的长度），收数据、批量解析和零拷贝都由Connection::read_frame()完成。
+// 一次recv收到的多个帧依次从缓冲区中取出，不需要再次recv；帧在一个分段内时
+// 直接引用分段的内存，跨分段时才复制到连接的暂存区。
+
+// payload limits of the length based codecs by default
+inline constexpr std::size_t kDEFAULT_MAX_FRAME = 16 * 1024 * 1024;
+// line_codec gives up on lines longer than this by default
+inline constexpr std::size_t kDEFAULT_MAX_LINE = 64 * 1024;
+
+
+/// where a frame at the front of the input is
+struct frame_layout
+{
+    std::size_t header{0};  // bytes before the payload
+    std::size_t payload{0};
+    std::size_t trailer{0}; // bytes after it, e.g. the delimiter
+    // codec state between the parse calls of one frame, e.g. how far a
+    // delimiter was searched for
+    std::size_t scanned{0};
+
+    std::size_t total() const noexcept { return header + payload + trailer; }
+};
+
+/// a frame handed out by Connection::read_frame(). the views point into the
+/// connection's input and stay valid until its next read.
+struct frame
+{
+    int status{0}; // frame bytes, 0 on eof, negative errno on error
+    std::span<const std::byte> bytes; // the whole frame
+    frame_layout layout;
+
+    /// no frame: eof (0) or a negative errno
+    static frame end(int status) noexcept {
+        frame f;
+        f.status = status;
+        return f;
+    }
+
+    explicit operator bool() const noexcept { return status > 0; }
+
+    std::span<const std::byte> header() const noexcept { return bytes.first(layout.header); }
+    std::span<const std::byte> payload() const noexcept { return bytes.subspan(layout.header, layout.payload); }
+
+    std::string_view text() const noexcept {
+        auto p = payload();
+        return {reinterpret_cast<const char*>(p.data()), p.size()};
+    }
+};
+
+
+/// a codec looks at the front of `in` and
+/// \return 0 with `out` filled once the frame's layout is known (the frame
+/// is complete when `in` holds out.total() bytes), the number of bytes `in`
+/// must hold before it can tell more, or a negative errno for a malformed
+/// or oversized frame.
+/// read_frame() calls it again with the same `out` after every recv until the
+/// frame is complete, state between these calls goes into out.scanned. a
+/// new frame starts with a fresh `out`, so a codec holds no per connection
+/// state and one may serve many connections.
+template <typename type>
+concept frame_codec = requires(type c, const chained_buffer& in, frame_layout& out)
+{
+    { c.parse(in, out) } -> std::same_as<int>;
+};
+
+
+} // namespace net
+
+
+namespace detail {
+
+/// big endian unsigned of `width` bytes, `in` must hold offset + width
+inline uint64_t peek_big_endian(const chained_buffer& in, std::size_t offset, std::size_t width) noexcept {
+    std::array<unsigned char, 8> bytes{};
+    in.peek(bytes.data(), width, offset);
+    uint64_t v = 0;
+    for (std::size_t i=0; i<width; ++i)
+        v = (v << 8) | bytes[i];
+    return v;
+}
+
+} // namespace detail
+
+
+namespace net {
+
+
+/// protobuf style varint (LEB128) length
+struct varint_prefix
+{
+    static constexpr std::size_t kMAX_BYTES = 10;
+
+    /// \return prefix length with `length` set, 0 if incomplete, -EPROTO if
+    /// the varint is longer than kMAX_BYTES.
+    static int decode(const chained_buffer& in, uint64_t& length) noexcept {
+        std::array<unsigned char, kMAX_BYTES> bytes;
+        auto n = in.peek(bytes.data(), bytes.size());
+        length = 0;
+        for (std::size_t i=0; i<n; ++i) {
+            length |= static_cast<uint64_t>(bytes[i] & 0x7f) << (7 * i);
+            if ((bytes[i] & 0x80) == 0)
+                return static_cast<int>(i + 1);
+        }
+        return n == kMAX_BYTES ? -EPROTO : 0;
+    }
+
+    static void encode(std::string& out, uint64_t length) {
+        while (length >= 0x80) {
+            out.push_back(static_cast<char>(length | 0x80));
+            length >>= 7;
+        }
+        out.push_back(static_cast<char>(length));
+    }
+};
+
+/// 4 byte big endian (network order) length
+struct u32_prefix
+{
+    static constexpr std::size_t kMAX_BYTES = 4;
+
+    static int decode(const chained_buffer& in, uint64_t& length) noexcept {
+        if (in.size() < kMAX_BYTES) return 0;
+        length = detail::peek_big_endian(in, 0, kMAX_BYTES);
+        return kMAX_BYTES;
+    }
+
+    static void encode(std::string& out, uint64_t length) {
+        for (int shift=24; shift>=0; shift-=8)
+            out.push_back(static_cast<char>(length >> shift));
+    }
+};
+
+
+/// a length prefix followed by that many payload bytes
+template <typename Prefix>
+class length_prefixed_codec
+{
+public:
+    explicit length_prefixed_codec(std::size_t max_payload = kDEFAULT_MAX_FRAME) noexcept
+        : max_payload_(max_payload)
+    {}
+
+    int parse(const chained_buffer& in, frame_layout& out) noexcept {
+        uint64_t length = 0;
+        int prefix = Prefix::decode(in, length);
+        if (prefix < 0) return prefix;
+        if (prefix == 0) return static_cast<int>(in.size() + 1);
+        if (length > max_payload_) return -EMSGSIZE;
+        out = frame_layout{static_cast<std::size_t>(prefix), static_cast<std::size_t>(length), 0};
+        return 0;
+    }
+
+    /// the prefix to send in front of a `length` bytes payload
+    static std::string encode_prefix(std::size_t length) {
+        std::string out;
+        Prefix::encode(out, length);
+        return out;
+    }
+
+private:
+    std::size_t max_payload_;
+};
+
+using varint_codec = length_prefixed_codec<varint_prefix>;
+using u32_codec = length_prefixed_codec<u32_prefix>;
+
+
+/// payloads ended by a delimiter, which is not part of the payload
+class line_codec
+{
+public:
+    explicit line_codec(std::string delim = "\n", std::size_t max_line = kDEFAULT_MAX_LINE)
+        : delim_(std::move(delim))
+        , max_line_(max_line)
+    {}
+
+    int parse(const chained_buffer& in, frame_layout& out) noexcept {
+        // out.scanned: bytes of the current frame without a delimiter
+        auto pos = in.find(delim_, out.scanned);
+        if (pos == chained_buffer::npos) {
+            if (in.size() >= max_line_) return -EMSGSIZE;
+            // a delimiter may straddle the bytes scanned and the next ones
+            out.scanned = in.size() >= delim_.size() ? in.size() - delim_.size() + 1 : 0;
+            return static_cast<int>(in.size() + 1);
+        }
+        out = frame_layout{0, pos, delim_.size()};
+        return 0;
+    }
+
+private:
+    std::string delim_;
+    std::size_t max_line_;
+};
+
+
+/// a fixed size header holding the payload length as a big endian unsigned of
+/// LengthWidth bytes at LengthOffset; with LengthIncludesHeader it counts the
+/// header too.
+template <std::size_t HeaderSize, std::size_t LengthOffset, std::size_t LengthWidth,
+          bool LengthIncludesHeader = false>
+class fixed_header_codec
+{
+    static_assert(LengthWidth >= 1 && LengthWidth <= 8);
+    static_assert(LengthOffset + LengthWidth <= HeaderSize);
+
+public:
+    static constexpr std::size_t kHEADER_SIZE = HeaderSize;
+
+    explicit fixed_header_codec(std::size_t max_payload = kDEFAULT_MAX_FRAME) noexcept
+        : max_payload_(max_payload)
+    {}
+
+    int parse(const chained_buffer& in, frame_layout& out) noexcept {
+        if (in.size() < HeaderSize) return static_cast<int>(HeaderSize);
+        auto length = detail::peek_big_endian(in, LengthOffset, LengthWidth);
+        if constexpr (LengthIncludesHeader) {
+            if (length < HeaderSize) return -EPROTO;
+            length -= HeaderSize;
+        }
+        if (length > max_payload_) return -EMSGSIZE;
+        out = frame_layout{HeaderSize, static_cast<std::size_t>(length), 0};
+        return 0;
+    }
+
+private:
+    std::size_t max_payload_;
+};
+
+
+/// a non-owning, type erased codec, for Connection::set_codec()
+class codec_ref
+{
+public:
+    codec_ref() noexcept = default;
+
+    template <frame_codec Codec>
+    codec_ref(Codec& codec) noexcept
+        : self_(&codec)
+        , parse_([](void* self, const chained_buffer& in, frame_layout& out) noexcept {
+            return static_cast<Codec*>(self)->parse(in, out);
+        })
+    {}
+
+    explicit operator bool() const noexcept { return self_ != nullptr; }
+
+    int parse(const chained_buffer& in, frame_layout& out) noexcept { return parse_(self_, in, out); }
+
+private:
+    void* self_{nullptr};
+    int (*parse_)(void*, const chained_buffer&, frame_layout&) noexcept {nullptr};
+};
+
+
+} // namespace net
+
+} // namespace sheep
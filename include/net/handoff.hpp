@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "net/socket.hpp"
+
+namespace sheep {
+
+namespace net {
+
+
+// 热重启：运行中的进程在本地Unix socket上等待新进程，通过SCM_RIGHTS把监听
+// socket的fd交给它。新进程开始accept后回复一个字节，旧进程收到后停止accept
+// 并drain已有的连接。监听socket在内核中一直存在，两个进程共享同一个backlog，
+// 所以切换期间不会丢失连接。
+// Unix socket的权限是0600，并且只把fd交给同一个用户（SO_PEERCRED）的进程。
+
+// at most this many listeners per handoff, well below SCM_MAX_FD
+inline constexpr std::size_t kMAX_HANDOFF_FDS = 64;
+
+
+/// send `fds` in a single message over a connected unix socket.
+/// \return 0 on success, negative errno otherwise.
+inline int send_fds(int sock, std::span<const int> fds) noexcept {
+    if (fds.empty() || fds.size() > kMAX_HANDOFF_FDS)
+        return -EINVAL;
+    char payload = static_cast<char>(fds.size());
+    iovec iov{&payload, sizeof(payload)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    while (::sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) return -errno;
+    }
+    return 0;
+}
+
+/// receive the fds sent by send_fds(), they are close-on-exec.
+/// \return number of fds appended to `fds`, negative errno otherwise.
+inline int recv_fds(int sock, std::vector<int>& fds) {
+    char payload = 0;
+    iovec iov{&payload, sizeof(payload)};
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * kMAX_HANDOFF_FDS));
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t n;
+    while ((n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+        if (errno != EINTR) return -errno;
+    }
+    if (n == 0) return -ECONNRESET;
+
+    int received = 0;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (std::size_t i=0; i<count; ++i) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+            ++received;
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) return -EMSGSIZE;
+    return received;
+}
+
+
+} // namespace net
+
+
+namespace detail {
+
+inline sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::logic_error("handoff: invalid unix socket path!");
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+} // namespace detail
+
+
+namespace net {
+
+
+/// the new process' end: connects to the running server and receives its
+/// listening sockets. ready() tells the old process to drain, call it once
+/// the listeners are being accepted on (Server does it in serve()).
+class listener_handoff
+{
+public:
+    /// \throw std::logic_error if no server listens at `path` or the
+    /// handoff fails.
+    explicit listener_handoff(const std::string& path) {
+        auto addr = detail::unix_address(path);
+        channel_ = Socket{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        if (channel_.fd() == -1)
+            throw std::logic_error("handoff: create socket failed!");
+        if (::connect(channel_.fd(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            std::cerr << strerror(errno) << std::endl;
+            throw std::logic_error("handoff: connect() error!");
+        }
+
+        std::vector<int> fds;
+        int ret = recv_fds(channel_.fd(), fds);
+        for (int fd: fds)
+            listeners_.emplace_back(fd);
+        if (ret <= 0) {
+            std::cerr << strerror(ret < 0 ? -ret : EPROTO) << std::endl;
+            throw std::logic_error("handoff: receive listeners error!");
+        }
+    }
+
+    listener_handoff(listener_handoff&&) noexcept = default;
+    listener_handoff& operator=(listener_handoff&&) noexcept = default;
+
+    /// the inherited listening sockets, in the order of the old server
+    std::vector<Socket> take_listeners() noexcept { return std::move(listeners_); }
+
+    /// \return 0 on success, negative errno otherwise.
+    int ready() noexcept {
+        if (channel_.fd() == -1) return 0;
+        char ack = 'R';
+        while (::send(channel_.fd(), &ack, sizeof(ack), MSG_NOSIGNAL) == -1) {
+            if (errno != EINTR) return -errno;
+        }
+        channel_ = Socket{};
+        return 0;
+    }
+
+private:
+    Socket channel_;
+    std::vector<Socket> listeners_;
+};
+
+
+/// the running process' end: serves its listening fds at `path` on a
+/// background thread. a new process that acknowledges them (see
+/// listener_handoff::ready()) triggers `on_handed_off`, which runs on that
+/// thread; one that goes away before is ignored and the next may try again.
+/// only processes of the same effective user get the fds.
+class handoff_server
+{
+public:
+    static constexpr int kPOLL_INTERVAL_MS = 100; // how often stop is checked
+
+    /// \throw std::logic_error if the unix socket can't be bound, or another
+    /// server still accepts at `path`.
+    handoff_server(std::string path, std::vector<int> fds, std::function<void()> on_handed_off)
+        : path_(std::move(path))
+        , fds_(std::move(fds))
+        , on_handed_off_(std::move(on_handed_off))
+    {
+        auto addr = detail::unix_address(path_);
+        sock_ = Socket{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        if (sock_.fd() == -1)
+            throw std::logic_error("handoff: create socket failed!");
+        // a previous process' socket file may be left, but don't take the
+        // path from a server still serving its listeners there
+        if (accepts_connections(addr))
+            throw std::logic_error("handoff: another server listens at the path!");
+        ::unlink(path_.c_str());
+        if (::bind(sock_.fd(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            std::cerr << strerror(errno) << std::endl;
+            throw std::logic_error("handoff: bind() error!");
+        }
+        // nobody can connect before listen(), so the window is harmless
+        if (::chmod(path_.c_str(), S_IRUSR | S_IWUSR) == -1) {
+            std::cerr << strerror(errno) << std::endl;
+            ::unlink(path_.c_str());
+            throw std::logic_error("handoff: chmod() error!");
+        }
+        sock_.listen();
+        thread_ = std::jthread{[this](std::stop_token st) { run(st); }};
+    }
+
+    handoff_server(const handoff_server&) = delete;
+    handoff_server& operator=(const handoff_server&) = delete;
+
+    ~handoff_server() noexcept {
+        thread_.request_stop();
+        if (thread_.joinable())
+            thread_.join();
+        // the new process binds the same path for its own successor
+        if (!handed_off_)
+            ::unlink(path_.c_str());
+    }
+
+private:
+    static bool accepts_connections(const sockaddr_un& addr) noexcept {
+        Socket probe{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        return probe.fd() != -1
+            && ::connect(probe.fd(), reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+    }
+
+    /// whether the peer of a unix socket runs as our effective user
+    static bool same_user(int fd) noexcept {
+        ucred cred{};
+        socklen_t len = sizeof(cred);
+        if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+            return false;
+        return cred.uid == ::geteuid();
+    }
+
+    /// wait until `fd` is readable or a stop is requested
+    static bool wait_readable(int fd, const std::stop_token& st) noexcept {
+        while (!st.stop_requested()) {
+            pollfd pfd{fd, POLLIN, 0};
+            int n = ::poll(&pfd, 1, kPOLL_INTERVAL_MS);
+            if (n > 0) return true;
+            if (n == -1 && errno != EINTR) return false;
+        }
+        return false;
+    }
+
+    void run(std::stop_token st) {
+        while (wait_readable(sock_.fd(), st)) {
+            Socket peer{::accept4(sock_.fd(), nullptr, nullptr, SOCK_CLOEXEC)};
+            if (peer.fd() == -1) continue;
+            if (!same_user(peer.fd())) {
+                std::cerr << "handoff: refused a peer of another user" << std::endl;
+                continue;
+            }
+
+            int ret = send_fds(peer.fd(), fds_);
+            if (ret < 0) {
+                std::cerr << "handoff: send listeners failed, reason: " << strerror(-ret) << std::endl;
+                continue;
+            }
+            char ack = 0;
+            if (!wait_readable(peer.fd(), st) || ::recv(peer.fd(), &ack, sizeof(ack), 0) != 1)
+                continue;
+
+            handed_off_ = true;
+            if (on_handed_off_) on_handed_off_();
+            return;
+        }
+    }
+
+    std::string path_;
+    std::vector<int> fds_;
+    std::function<void()> on_handed_off_;
+    Socket sock_;
+    bool handed_off_{false};
+    std::jthread thread_; // last, joined before the members it uses go away
+};
+
+
+} // namespace net
+
+} // namespace sheep
@@ -10,6 +10,7 @@
 #include <iostream>
 
 #include "address.hpp"
+#include "slab_pool.hpp"
 
 namespace sheep {
 
@@ -24,6 +25,9 @@ public:
 
     explicit Socket(int fd) : fd_(fd) {}
 
+    static void* operator new(std::size_t size) { return detail::slab_new<Socket>(size); }
+    static void operator delete(void* p, std::size_t size) noexcept { detail::slab_delete<Socket>(p, size); }
+
     ~Socket() {
         if (fd_ != -1) ::close(fd_);
         fd_ = -1;
@@ -41,6 +45,9 @@ public:
 
     int fd() const noexcept { return fd_; }
 
+    /// give up ownership, the caller closes the returned fd
+    int release() noexcept { return std::exchange(fd_, -1); }
+
     void bind(Address& serve_addr, bool resuable = true) {
         if (fd_ == -1) {
             create_socket(serve_addr.protocol());
@@ -98,6 +105,22 @@ public:
             throw std::logic_error("Socket: set_nonblocking() error!");
     }
 
+    /// prefer this listener for connections whose packets are processed on
+    /// `cpu` (reuseport groups, linux 6.2+), ignored by older kernels.
+    void set_incoming_cpu(int cpu) noexcept {
+        assert(fd_ != -1);
+        ::setsockopt(fd_, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+
+    /// cpu that processed the last packets of this socket, -1 if unknown
+    int incoming_cpu() const noexcept {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (::getsockopt(fd_, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+            return -1;
+        return cpu;
+    }
+
     int get_attrs() {
         assert(fd_ != -1);
         return ::fcntl(fd_, F_GETFL);
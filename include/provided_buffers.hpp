@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <liburing.h>
+#include <span>
+#include <string_view>
+#include <sys/mman.h>
+#include <utility>
+
+namespace sheep {
+
+
+/// a provided buffer ring (kernel 5.19+): a group of equally sized buffers
+/// shared by all operations of one io_uring. the kernel picks a buffer only
+/// when data actually arrives, so idle sockets don't pin any read memory.
+/// not thread safe, only touched by the thread driving the ring.
+class provided_buffer_ring
+{
+public:
+    provided_buffer_ring() noexcept = default;
+    provided_buffer_ring(const provided_buffer_ring&) = delete;
+    provided_buffer_ring& operator=(const provided_buffer_ring&) = delete;
+
+    ~provided_buffer_ring() noexcept {
+        if (br_ != nullptr)
+            io_uring_free_buf_ring(ring_, br_, entries_, group_id_);
+        if (slab_ != nullptr)
+            ::munmap(slab_, static_cast<std::size_t>(entries_) * buffer_size_);
+    }
+
+    /// register the buffer group with the ring
+    /// \param entries number of buffers, must be a power of 2.
+    /// \param buffer_size size of every buffer.
+    /// \param group_id buffer group id used by sqes selecting from this ring.
+    /// \return 0 on success, negative errno otherwise.
+    int setup(io_uring* ring, unsigned entries, unsigned buffer_size, int group_id) noexcept {
+        assert((entries & (entries - 1)) == 0);
+        // pages are committed on first touch, i.e. when the kernel fills a buffer
+        auto bytes = static_cast<std::size_t>(entries) * buffer_size;
+        void* slab = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) return -errno;
+
+        int ret = 0;
+        br_ = io_uring_setup_buf_ring(ring, entries, group_id, 0, &ret);
+        if (br_ == nullptr) {
+            ::munmap(slab, bytes);
+            return ret;
+        }
+        ring_ = ring;
+        slab_ = static_cast<std::byte*>(slab);
+        entries_ = entries;
+        buffer_size_ = buffer_size;
+        group_id_ = group_id;
+        mask_ = io_uring_buf_ring_mask(entries);
+        for (unsigned bid = 0; bid < entries; ++bid)
+            io_uring_buf_ring_add(br_, buffer(bid), buffer_size_, bid, mask_, bid);
+        io_uring_buf_ring_advance(br_, entries);
+        return 0;
+    }
+
+    std::byte* buffer(uint16_t bid) noexcept {
+        return slab_ + static_cast<std::size_t>(bid) * buffer_size_;
+    }
+
+    /// hand a consumed buffer back to the kernel
+    void recycle(uint16_t bid) noexcept {
+        io_uring_buf_ring_add(br_, buffer(bid), buffer_size_, bid, mask_, 0);
+        io_uring_buf_ring_advance(br_, 1);
+    }
+
+    /// recycle the buffer selected by a completion, if any
+    void recycle_cqe(unsigned cqe_flags) noexcept {
+        if (cqe_flags & IORING_CQE_F_BUFFER)
+            recycle(static_cast<uint16_t>(cqe_flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+
+    int group_id() const noexcept { return group_id_; }
+    unsigned buffer_size() const noexcept { return buffer_size_; }
+    unsigned entries() const noexcept { return entries_; }
+
+private:
+    io_uring* ring_{nullptr};
+    io_uring_buf_ring* br_{nullptr};
+    std::byte* slab_{nullptr};
+    unsigned entries_{0};
+    unsigned buffer_size_{0};
+    int group_id_{0};
+    int mask_{0};
+};
+
+
+/// a buffer the kernel picked from a provided_buffer_ring for one completion.
+/// returns the buffer to the ring when destroyed, so it has to die on the
+/// thread driving the ring.
+class provided_buffer
+{
+public:
+    provided_buffer() noexcept = default;
+
+    provided_buffer(provided_buffer_ring* ring, int result, unsigned cqe_flags) noexcept
+        : result_(result)
+    {
+        if (ring != nullptr && (cqe_flags & IORING_CQE_F_BUFFER)) {
+            ring_ = ring;
+            bid_ = static_cast<uint16_t>(cqe_flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+    }
+
+    provided_buffer(const provided_buffer&) = delete;
+    provided_buffer& operator=(const provided_buffer&) = delete;
+
+    provided_buffer(provided_buffer&& other) noexcept
+        : ring_(std::exchange(other.ring_, nullptr))
+        , bid_(other.bid_)
+        , result_(std::exchange(other.result_, 0))
+    {}
+
+    provided_buffer& operator=(provided_buffer&& other) noexcept {
+        if (this == &other) return *this;
+        release();
+        ring_ = std::exchange(other.ring_, nullptr);
+        bid_ = other.bid_;
+        result_ = std::exchange(other.result_, 0);
+        return *this;
+    }
+
+    ~provided_buffer() { release(); }
+
+    /// bytes received, 0 on eof, negative errno on failure
+    /// (-ENOBUFS: the ring ran out of buffers).
+    int result() const noexcept { return result_; }
+    std::size_t size() const noexcept { return result_ > 0 ? result_ : 0; }
+
+    const std::byte* data() const noexcept {
+        return ring_ ? ring_->buffer(bid_) : nullptr;
+    }
+
+    std::span<const std::byte> bytes() const noexcept { return {data(), size()}; }
+
+    std::string_view to_string() const noexcept {
+        return {reinterpret_cast<const char*>(data()), size()};
+    }
+
+    /// give the buffer back to the kernel before destruction
+    void release() noexcept {
+        if (ring_ != nullptr)
+            std::exchange(ring_, nullptr)->recycle(bid_);
+    }
+
+private:
+    provided_buffer_ring* ring_{nullptr};
+    uint16_t bid_{0};
+    int result_{0};
+};
+
+
+}
@@ -1,72 +1,395 @@
 #pragma once
 
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <coroutine>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
 #include <thread>
 #include <functional>
 #include <iostream>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
+#include "admission.hpp"
 #include "task.hpp"
 #include "types.hpp"
 #include "io_service_pool.hpp"
 #include "net/address.hpp"
 #include "net/socket.hpp"
 #include "net/connection.hpp"
+#include "net/handoff.hpp"
 #include "thread_pool.hpp"
+#include "timeout.hpp"
 
 namespace sheep {
 
 
+enum class accept_mode
+{
+    // one listening socket, accepted on the acceptor ring and handed to the workers
+    Acceptor,
+    // every worker owns a SO_REUSEPORT listener and accepts on its own ring,
+    // the kernel distributes connections and they never cross threads
+    ReusePort
+};
+
+
+/// outcome of Server::shutdown(), counted in sessions
+struct shutdown_report
+{
+    std::size_t drained{0};   // finished before the deadline, idle ones were closed
+    std::size_t cancelled{0}; // finished after their io was cancelled at the deadline
+    std::size_t abandoned{0}; // still suspended on something else, left behind
+};
+
 
 class Server
 {
 public:
+    // pause of an acceptor that ran out of fds or memory
+    static constexpr std::chrono::milliseconds kACCEPT_BACKOFF{50};
+    // cancel groups (io_service::cancel_group()) of the connections' io,
+    // cancelled on every worker ring when draining starts and at the deadline
+    static constexpr unsigned kDRAIN_GROUP = 1;
+    static constexpr unsigned kSTOP_GROUP = 2;
+
     using handler_t = sheep::task<> (*)(std::unique_ptr<sheep::net::Connection>);
 
-    explicit Server(net::Address listen_addr, int concurrency = std::thread::hardware_concurrency())
+    explicit Server(net::Address listen_addr, int concurrency = std::thread::hardware_concurrency(),
+        accept_mode mode = accept_mode::Acceptor, const io_service_options& ring_options = {},
+        const cpu_placement& placement = {})
         : listen_addr_(listen_addr)
-        , io_services_(concurrency)
-        , thread_pool_(concurrency, io_services_)
+        , mode_(mode)
+        , admission_(std::make_unique<admission_control>(admission_limits{}, concurrency))
+        , io_services_(concurrency, ring_options, placement)
+        , thread_pool_(concurrency, io_services_, placement)
     {
-        listen_sock_.bind(listen_addr_, true);
-        listen_sock_.listen();
+        open_listeners(concurrency, ring_options, placement, {});
+    }
+
+    /// hot restart: take over the listening sockets of a running server
+    /// instead of binding new ones (see enable_handoff()). serve() tells the
+    /// old process to drain once this server accepts. every inherited
+    /// listener needs a worker accepting on it, the kernel keeps hashing
+    /// connections into its backlog; more workers bind additional ones.
+    /// \throw std::logic_error if the old server has more listeners than
+    /// this one accepts on (fewer reuseport workers, or acceptor mode). the
+    /// old server is not told to drain and keeps serving.
+    Server(net::Address listen_addr, net::listener_handoff handoff,
+        int concurrency = std::thread::hardware_concurrency(),
+        accept_mode mode = accept_mode::Acceptor, const io_service_options& ring_options = {},
+        const cpu_placement& placement = {})
+        : listen_addr_(listen_addr)
+        , mode_(mode)
+        , admission_(std::make_unique<admission_control>(admission_limits{}, concurrency))
+        , io_services_(concurrency, ring_options, placement)
+        , thread_pool_(concurrency, io_services_, placement)
+        , inherited_from_(std::move(handoff))
+    {
+        open_listeners(concurrency, ring_options, placement, inherited_from_->take_listeners());
     }
 
     void set_handler(handler_t h) {
         client_handler_ = h;
     }
 
+    /// cap connections and their buffer memory, call before serve().
+    /// unlimited by default. with a per worker cap sessions aren't stolen
+    /// by idle workers, which would take them over their cap.
+    void set_admission_limits(const admission_limits& limits) {
+        admission_ = std::make_unique<admission_control>(limits, io_services_.size());
+        thread_pool_.set_stealing(limits.max_connections_per_worker == 0);
+    }
+
+    /// connections admitted, shed and open, buffer memory in use
+    admission_stats admission() const { return admission_->stats(); }
+
     task<> serve() {
         assert(client_handler_ != nullptr);
-        thread_pool_.start();
         // log
         std::cout << "Server listen on: " << listen_addr_.to_string() << std::endl;
-        while (true)
+        if (mode_ == accept_mode::ReusePort) {
+            thread_pool_.start([this](thread_meta thread) {
+                // not a session: it frees itself and isn't counted by shutdown()
+                auto acceptor = accept_loop(io_services_.get_io_service(thread),
+                    worker_socks_[thread.thread_id].fd(), thread.thread_id).detach();
+                acceptor.promise().set_completion(
+                    [](detail::task_promise_base&, std::coroutine_handle<> coro, void*) noexcept {
+                        coro.destroy();
+                    }, nullptr);
+                acceptor.resume();
+            });
+            signal_handoff_ready();
+            thread_pool_.join();
+            co_return;
+        }
+
+        thread_pool_.start();
+        acceptor_ios_.enable_on_this_thread();
+        auto acceptor = accept_loop(acceptor_ios_, listen_sock_.fd(), -1);
+        // both processes accept from the same backlog until the old one stops
+        signal_handoff_ready();
+        acceptor_ios_.run_task(acceptor);
+        // the workers are still draining, return once shutdown() stopped them
+        thread_pool_.join();
+        co_return;
+    }
+
+    /// graceful shutdown, call it from a thread other than the workers (e.g.
+    /// one waiting for SIGTERM); serve() returns once it is done.
+    ///  1. stop accepting, the listening sockets stay open until destruction
+    ///  2. drain: connections waiting for their next request are closed (their
+    ///     recv returns -ECANCELED), in-flight requests get to finish
+    ///  3. at `deadline` cancel the io of every remaining connection through
+    ///     its ring and give the sessions `cancel_grace` to unwind
+    ///  4. stop the workers
+    /// sessions suspended on anything but their connection's io are left
+    /// behind and counted as abandoned.
+    shutdown_report shutdown(std::chrono::steady_clock::time_point deadline,
+        std::chrono::milliseconds cancel_grace = std::chrono::seconds{1})
+    {
+        shutdown_report report;
+        if (shutting_down_.exchange(true, std::memory_order_acq_rel))
+            return report;
+
+        stop_accepting(deadline);
+        auto live = thread_pool_.live_sessions();
+        cancel_connections(kDRAIN_GROUP);
+        thread_pool_.wait_idle(deadline);
+
+        auto remaining = thread_pool_.live_sessions();
+        report.drained = live - std::min(live, remaining);
+        if (remaining > 0) {
+            cancel_connections(kSTOP_GROUP);
+            thread_pool_.wait_idle(std::chrono::steady_clock::now() + cancel_grace);
+            report.abandoned = thread_pool_.live_sessions();
+            report.cancelled = remaining - std::min(remaining, report.abandoned);
+        }
+        thread_pool_.stop();
+        return report;
+    }
+
+    template <typename Rep, typename Period>
+    shutdown_report shutdown(std::chrono::duration<Rep, Period> drain_timeout,
+        std::chrono::milliseconds cancel_grace = std::chrono::seconds{1})
+    {
+        return shutdown(std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(drain_timeout), cancel_grace);
+    }
+
+    /// serve the listening sockets to a successor process at the unix socket
+    /// `path` (see net::listener_handoff). once it accepts, this server
+    /// shuts down with `drain_timeout`, serve() returns and `on_done` gets the
+    /// report. the listeners stay in the kernel throughout, so no connection
+    /// is refused during the switch.
+    void enable_handoff(std::string path, std::chrono::milliseconds drain_timeout,
+        std::function<void(const shutdown_report&)> on_done = nullptr)
+    {
+        std::vector<int> fds;
+        if (mode_ == accept_mode::ReusePort) {
+            for (auto& sock: worker_socks_)
+                fds.push_back(sock.fd());
+        } else {
+            fds.push_back(listen_sock_.fd());
+        }
+        handoff_ = std::make_unique<net::handoff_server>(std::move(path), std::move(fds),
+            [this, drain_timeout, on_done = std::move(on_done)] {
+                auto report = shutdown(drain_timeout);
+                if (on_done) on_done(report);
+            });
+    }
+
+private:
+    void open_listeners(int concurrency, const io_service_options& ring_options,
+        const cpu_placement& placement, std::vector<net::Socket> inherited)
+    {
+        std::size_t used = mode_ == accept_mode::ReusePort ? concurrency : 1;
+        if (inherited.size() > used) {
+            std::cerr << "Server: " << inherited.size() << " inherited listeners, "
+                      << used << " accepted on" << std::endl;
+            throw std::logic_error("Server: handoff needs a worker for every inherited listener!");
+        }
+        if (mode_ == accept_mode::ReusePort) {
+            worker_socks_.reserve(concurrency);
+            for (int i=0; i<concurrency; ++i) {
+                if (static_cast<std::size_t>(i) < inherited.size()) {
+                    worker_socks_.push_back(std::move(inherited[i]));
+                } else {
+                    // joins the reuseport group of the inherited listeners
+                    auto& sock = worker_socks_.emplace_back();
+                    sock.bind(listen_addr_, true);
+                    sock.listen();
+                }
+                // the kernel picks the listener of the worker on the nic queue's cpu
+                if (placement.steer_incoming_cpu && placement.pinned())
+                    worker_socks_.back().set_incoming_cpu(placement.worker_cpu(i));
+            }
+        } else {
+            if (!inherited.empty()) {
+                listen_sock_ = std::move(inherited.front());
+            } else {
+                listen_sock_.bind(listen_addr_, true);
+                listen_sock_.listen();
+            }
+            acceptor_ios_.init(ring_options);
+        }
+    }
+
+    void signal_handoff_ready() {
+        if (!inherited_from_) return;
+        int ret = inherited_from_->ready();
+        if (ret < 0)
+            std::cerr << "Server: handoff ack failed, reason: " << std::strerror(-ret) << std::endl;
+        inherited_from_.reset();
+    }
+
+    /// accept new connections on the given ring, a single multishot sqe
+    /// keeps posting client fds which are handed straight to the workers.
+    /// kernels without multishot accept get one accept sqe per connection,
+    /// running out of fds or memory pauses the loop for kACCEPT_BACKOFF.
+    /// \param worker the worker running the loop, -1 for the acceptor ring.
+    task<> accept_loop(io_service& ios, int listen_fd, int worker) {
+        // abandoned on exit, the cancelled accept may still complete later
+        auto accepted = std::make_unique<multishot_handle>();
+        bool multishot = true;
+        register_acceptor(ios, accepted.get());
+        while (accepting_.load(std::memory_order_acquire))
         {
-            // accept new connection
-            net::Address client_addr;
-
-            auto client_fd = listen_sock_.accept(client_addr);
-            if (client_fd < 1) continue;
-            // log
-            std::cout << " accept client: " << client_addr.to_string() << std::endl;
-            auto client_sock = std::make_unique<net::Socket>(client_fd);
-            auto conn = std::make_unique<net::Connection>(std::move(client_sock));
-            conn->set_client_addr(client_addr);
-            auto pconn = conn.get();
-            auto session = client_handler_(std::move(conn));
-
-            thread_pool_.submit(session_wrapper{session.detach(), pconn});
+            if (admission_->limits().on_overload == overload_action::Pause && !admission_->has_room()) {
+                // stop taking connections off the backlog until one closes
+                if (accepted->armed())
+                    ios.post_cancel(accepted.get());
+                co_await admission_->wait_for_room();
+                continue;
+            }
+            int client_fd;
+            if (multishot) {
+                if (!accepted->armed())
+                    ios.multishot_accept(listen_fd, *accepted, SOCK_CLOEXEC);
+                client_fd = (co_await accepted->next()).result;
+            } else {
+                client_fd = co_await ios.accept(listen_fd, nullptr, nullptr, SOCK_CLOEXEC)
+                    .cancel_on(accept_stop_.get_token());
+            }
+            if (client_fd < 0) [[unlikely]] {
+                if (client_fd == -EINVAL) {
+                    if (!multishot) {
+                        std::cerr << "Server: accept failed, reason: " << std::strerror(EINVAL)
+                                  << ". Stop accepting!" << std::endl;
+                        break;
+                    }
+                    // kernels before 5.19 don't know multishot accept
+                    std::cerr << "Server: multishot accept unsupported, "
+                              << "falling back to single shot accept" << std::endl;
+                    multishot = false;
+                } else if (client_fd == -EMFILE || client_fd == -ENFILE
+                    || client_fd == -ENOBUFS || client_fd == -ENOMEM) {
+                    // out of fds or memory, accepting again right away would spin
+                    co_await sleep_for(ios, kACCEPT_BACKOFF, accept_stop_.get_token());
+                }
+                continue;
+            }
+            if (!accepting_.load(std::memory_order_acquire)) {
+                ::close(client_fd);
+                break;
+            }
+            dispatch(client_fd, worker);
         }
+        unregister_acceptor(accepted.get());
+        // closes the fds accepted after the cancel, queued or still to come
+        ios.abandon(std::move(accepted));
         co_return;
     }
 
+    void register_acceptor(io_service& ios, multishot_handle* handle) {
+        std::lock_guard<std::mutex> g{acceptors_mutex_};
+        acceptors_.emplace_back(&ios, handle);
+    }
+
+    void unregister_acceptor(multishot_handle* handle) {
+        std::lock_guard<std::mutex> g{acceptors_mutex_};
+        std::erase_if(acceptors_, [&](auto& a) { return a.second == handle; });
+        acceptors_cv_.notify_all();
+    }
+
+    /// cancel the accepts through their rings and wait for the loops to exit
+    void stop_accepting(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lk{acceptors_mutex_};
+        // checked by a loop after registering, it either sees the flag or
+        // gets its accept cancelled
+        accepting_.store(false, std::memory_order_release);
+        for (auto& [ios, handle]: acceptors_)
+            ios->post_cancel(handle);
+        // single shot accepts and back-off sleeps
+        accept_stop_.request_stop();
+        admission_->wake_all();
+        acceptors_cv_.wait_until(lk, deadline, [this] { return acceptors_.empty(); });
+    }
+
+    /// every worker ring cancels the connection io of `group` on its thread
+    void cancel_connections(unsigned group) {
+        for (std::size_t i=0; i<io_services_.size(); ++i)
+            io_services_.get_io_service(thread_meta{static_cast<uint16_t>(i)}).cancel_group(group);
+    }
+
+    /// \param acceptor the worker that accepted the connection, -1 for the
+    /// acceptor ring.
+    void dispatch(int client_fd, int acceptor) {
+        auto client_sock = std::make_unique<net::Socket>(client_fd);
+        int preferred = acceptor;
+        if (mode_ == accept_mode::Acceptor && thread_pool_.placement().steer_incoming_cpu)
+            preferred = thread_pool_.worker_for_cpu(client_sock->incoming_cpu());
+        auto ticket = admission_->try_admit(preferred);
+        if (!ticket) {
+            // over budget: shed before any memory is spent on it
+            admission_->count_shed();
+            return;
+        }
+        int worker = ticket.worker();
+        auto conn = std::make_unique<net::Connection>(std::move(client_sock));
+        conn->set_admission(std::move(ticket));
+        conn->set_cancel_groups(kDRAIN_GROUP | kSTOP_GROUP, kSTOP_GROUP);
+        auto pconn = conn.get();
+        auto session = client_handler_(std::move(conn));
+
+        if (worker == acceptor)
+            // accepted on the worker's own ring, keep it on this thread
+            thread_pool_.spawn(session_wrapper{session.detach(), pconn});
+        else
+            // the acceptor ring, or a reuseport worker over its own limit
+            thread_pool_.submit_to(worker, session_wrapper{session.detach(), pconn});
+    }
+
 private:
     net::Address listen_addr_;
+    accept_mode mode_;
     net::Socket listen_sock_;
+    std::vector<net::Socket> worker_socks_;
+    // connections hold tickets into it: declared before the rings and the
+    // pool, so it outlives the sessions torn down with them
+    std::unique_ptr<admission_control> admission_;
+    io_service acceptor_ios_;
     io_service_pool io_services_;
     thread_pool thread_pool_;
     std::function<sheep::task<void>(std::unique_ptr<net::Connection>)> client_handler_{nullptr};
+
+    std::atomic<bool> accepting_{true};
+    std::stop_source accept_stop_;
+    std::atomic<bool> shutting_down_{false};
+    std::mutex acceptors_mutex_;
+    std::condition_variable acceptors_cv_;
+    std::vector<std::pair<io_service*, multishot_handle*>> acceptors_;
+    std::optional<net::listener_handoff> inherited_from_;
+    // last: its thread calls shutdown() and is joined before anything else goes
+    std::unique_ptr<net::handoff_server> handoff_;
 };
 
 
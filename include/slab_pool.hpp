@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <sys/mman.h>
+
+namespace sheep {
+
+
+namespace detail {
+
+
+inline std::atomic<bool>& slab_hugepages() noexcept {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+// slabs are aligned to their size, a block finds its slab (and its owner) by
+// masking its address
+inline constexpr std::size_t kSLAB_SIZE = std::size_t{2} << 20;
+inline constexpr std::size_t kSLAB_HEADER = 64;
+
+/// map a kSLAB_SIZE aligned slab, backed by huge pages when enabled:
+/// explicit ones (MAP_HUGETLB) if reserved, else transparent ones.
+inline void* map_slab() noexcept {
+    bool huge = slab_hugepages().load(std::memory_order_relaxed);
+    if (huge) {
+        void* p = ::mmap(nullptr, kSLAB_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return p;
+    }
+    // over-map and trim to get the alignment
+    void* raw = ::mmap(nullptr, 2 * kSLAB_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return nullptr;
+    auto begin = reinterpret_cast<uintptr_t>(raw);
+    auto aligned = (begin + kSLAB_SIZE - 1) & ~(kSLAB_SIZE - 1);
+    if (aligned > begin)
+        ::munmap(raw, aligned - begin);
+    auto end = begin + 2 * kSLAB_SIZE;
+    if (end > aligned + kSLAB_SIZE)
+        ::munmap(reinterpret_cast<void*>(aligned + kSLAB_SIZE), end - aligned - kSLAB_SIZE);
+    if (huge)
+        ::madvise(reinterpret_cast<void*>(aligned), kSLAB_SIZE, MADV_HUGEPAGE);
+    return reinterpret_cast<void*>(aligned);
+}
+
+
+// 按线程划分的slab内存池，每种块大小一个：块从所属线程的2MB slab中切出，
+// 所属线程释放时放回本地空闲链表（无锁、无原子操作）；其他线程释放时压入
+// 所属线程的远程链表（无锁栈），所属线程在本地链表为空时一次性取回。
+// 这样acceptor线程分配、worker线程释放的连接对象会回到acceptor线程复用，
+// 不会在worker线程堆积。线程退出后池子在最后一个块释放时销毁。
+template <std::size_t BlockSize>
+class slab_pool
+{
+    static_assert(BlockSize % alignof(std::max_align_t) == 0);
+    static_assert(BlockSize <= kSLAB_SIZE - kSLAB_HEADER);
+
+public:
+    static void* allocate() {
+        slab_pool* pool = current_;
+        if (pool == nullptr) [[unlikely]] {
+            if (retired_)
+                // the thread is exiting, serve it from a throwaway pool
+                return (new slab_pool{0})->take();
+            pool = new slab_pool{1};
+            current_ = pool;
+            static thread_local retire_guard guard;
+        }
+        return pool->take();
+    }
+
+    static void deallocate(void* p) noexcept {
+        auto slab = reinterpret_cast<slab_header*>(
+            reinterpret_cast<uintptr_t>(p) & ~(kSLAB_SIZE - 1));
+        slab->owner->give_back(static_cast<free_block*>(p));
+    }
+
+private:
+    struct free_block { free_block* next; };
+    struct slab_header
+    {
+        slab_pool* owner;
+        slab_header* next;
+    };
+
+    // drops the owner's reference when the thread exits
+    struct retire_guard
+    {
+        ~retire_guard() noexcept {
+            auto pool = current_;
+            current_ = nullptr;
+            retired_ = true;
+            if (pool != nullptr) pool->release_ref();
+        }
+    };
+
+    /// \param refs 1 for a pool owned by a thread, 0 for a throwaway one
+    explicit slab_pool(std::size_t refs) noexcept : refs_(refs) {}
+
+    ~slab_pool() noexcept {
+        while (slabs_ != nullptr) {
+            auto slab = slabs_;
+            slabs_ = slab->next;
+            ::munmap(slab, kSLAB_SIZE);
+        }
+    }
+
+    void* take() {
+        if (free_ == nullptr)
+            free_ = remote_.exchange(nullptr, std::memory_order_acquire);
+        void* p;
+        if (free_ != nullptr) {
+            p = free_;
+            free_ = free_->next;
+        } else {
+            if (cursor_ + BlockSize > limit_)
+                add_slab();
+            p = reinterpret_cast<void*>(cursor_);
+            cursor_ += BlockSize;
+        }
+        refs_.fetch_add(1, std::memory_order_relaxed);
+        return p;
+    }
+
+    void give_back(free_block* block) noexcept {
+        if (this == current_) {
+            block->next = free_;
+            free_ = block;
+            refs_.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        auto head = remote_.load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!remote_.compare_exchange_weak(head, block,
+            std::memory_order_release, std::memory_order_relaxed));
+        release_ref();
+    }
+
+    void release_ref() noexcept {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    void add_slab() {
+        auto slab = static_cast<slab_header*>(map_slab());
+        if (slab == nullptr)
+            throw std::bad_alloc{};
+        slab->owner = this;
+        slab->next = slabs_;
+        slabs_ = slab;
+        cursor_ = reinterpret_cast<uintptr_t>(slab) + kSLAB_HEADER;
+        limit_ = reinterpret_cast<uintptr_t>(slab) + kSLAB_SIZE;
+    }
+
+    free_block* free_{nullptr};
+    uintptr_t cursor_{0};
+    uintptr_t limit_{0};
+    slab_header* slabs_{nullptr};
+    // live blocks, plus one held by the owning thread until it exits
+    std::atomic<std::size_t> refs_;
+    alignas(64) std::atomic<free_block*> remote_{nullptr};
+
+    inline static thread_local slab_pool* current_{nullptr};
+    inline static thread_local bool retired_{false};
+};
+
+
+constexpr std::size_t slab_block_size(std::size_t size) noexcept {
+    constexpr auto align = alignof(std::max_align_t);
+    return (size + align - 1) / align * align;
+}
+
+/// class-level operator new/delete for objects allocated on one thread and
+/// freed on another, e.g. connections created by the acceptor. a derived
+/// class of another size goes to the global operator new.
+template <typename T>
+void* slab_new(std::size_t size) {
+    if (size != sizeof(T)) [[unlikely]] return ::operator new(size);
+    return slab_pool<slab_block_size(sizeof(T))>::allocate();
+}
+
+template <typename T>
+void slab_delete(void* p, std::size_t size) noexcept {
+    if (size != sizeof(T)) [[unlikely]] {
+        ::operator delete(p);
+        return;
+    }
+    slab_pool<slab_block_size(sizeof(T))>::deallocate(p);
+}
+
+
+} // namespace detail
+
+
+/// back slabs mapped from now on with huge pages (2MB), which cuts the tlb
+/// misses of connection heavy servers. explicit huge pages are used when
+/// the system reserved some (vm.nr_hugepages), transparent ones otherwise.
+/// call it before the server starts.
+inline void set_slab_hugepages(bool enabled) noexcept {
+    detail::slab_hugepages().store(enabled, std::memory_order_relaxed);
+}
+
+
+}
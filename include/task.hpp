@@ -1,10 +1,13 @@
 #pragma once 
 
 #include <coroutine>
+#include <cstddef>
 #include <exception>
 #include <type_traits>
 #include <utility>
 
+#include "frame_pool.hpp"
+
 namespace sheep
 {
 
@@ -19,19 +22,33 @@ namespace detail
 
 struct task_promise_base
 {
+    /// called when a coroutine without continuation (e.g. a detached session)
+    /// reaches its final suspend point, the coroutine may be destroyed inside.
+    using completion_fn = void (*)(task_promise_base&, std::coroutine_handle<>, void*) noexcept;
+
     task_promise_base() noexcept = default;
     ~task_promise_base() noexcept = default;
 
+    // coroutine frames come from a per-thread size-class pool, the sized
+    // delete is picked by the compiler and passes the frame size back
+    static void* operator new(std::size_t size) { return frame_pool::allocate(size); }
+    static void operator delete(void* p, std::size_t size) noexcept {
+        frame_pool::deallocate(p, size);
+    }
+
 struct final_awaitable
 {
     bool await_ready() const noexcept { return false; }    
 
     template <std::derived_from<task_promise_base> promise>
     std::coroutine_handle<> await_suspend(std::coroutine_handle<promise> coro) const noexcept {
-        if (coro.promise().continue_ != nullptr)
-            return coro.promise().continue_;
-        else
-            return std::noop_coroutine();
+        auto& p = coro.promise();
+        if (p.continue_ != nullptr)
+            return p.continue_;
+        if (p.on_complete_ != nullptr)
+            // may destroy the frame (and this awaitable), don't touch it afterwards
+            p.on_complete_(p, coro, p.complete_ctx_);
+        return std::noop_coroutine();
     }
 
     void await_resume() const noexcept {}
@@ -42,11 +59,70 @@ struct final_awaitable
     final_awaitable final_suspend() noexcept { return {}; }
     void unhandled_exception() { exception_ = std::current_exception(); }
     void set_continue(std::coroutine_handle<> coro) noexcept { continue_ = coro; }
+    void set_completion(completion_fn fn, void* ctx) noexcept {
+        on_complete_ = fn;
+        complete_ctx_ = ctx;
+    }
+    /// the coroutine exited with an exception, result() rethrows it
+    bool failed() const noexcept { return exception_ != nullptr; }
 
 protected:
     friend struct final_awaitable;
+    friend class promise_list;
     std::coroutine_handle<> continue_{nullptr};
     std::exception_ptr exception_;
+    completion_fn on_complete_{nullptr};
+    void* complete_ctx_{nullptr};
+    // intrusive hook of promise_list
+    task_promise_base* prev_{nullptr};
+    task_promise_base* next_{nullptr};
+};
+
+
+/// intrusive doubly linked list of promises, O(1) insert and erase
+/// without allocation. not thread safe, owned by a single thread.
+class promise_list
+{
+public:
+    promise_list() noexcept = default;
+    promise_list(const promise_list&) = delete;
+    promise_list& operator=(const promise_list&) = delete;
+
+    void push_back(task_promise_base& p) noexcept {
+        p.prev_ = tail_;
+        p.next_ = nullptr;
+        if (tail_) tail_->next_ = &p;
+        else head_ = &p;
+        tail_ = &p;
+        ++size_;
+    }
+
+    void erase(task_promise_base& p) noexcept {
+        if (p.prev_) p.prev_->next_ = p.next_;
+        else head_ = p.next_;
+        if (p.next_) p.next_->prev_ = p.prev_;
+        else tail_ = p.prev_;
+        p.prev_ = p.next_ = nullptr;
+        --size_;
+    }
+
+    template <typename Fn>
+    void for_each(Fn&& fn) {
+        for (auto p = head_; p != nullptr; ) {
+            // fn may erase p
+            auto next = p->next_;
+            fn(*p);
+            p = next;
+        }
+    }
+
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t size() const noexcept { return size_; }
+
+private:
+    task_promise_base* head_{nullptr};
+    task_promise_base* tail_{nullptr};
+    std::size_t size_{0};
 };
 
 
@@ -132,6 +208,8 @@ struct [[nodiscard]] task
         return !coro_ || coro_.done();
     }
 
+    coroutine_handle handle() const noexcept { return coro_; }
+
     coroutine_handle detach() noexcept {
         auto ret = coro_;
         coro_ = nullptr;
@@ -146,7 +224,8 @@ struct [[nodiscard]] task
                     this->coro_.promise().result();
                     return;
                 } else {
-                    return this->coro_.promise().result();
+                    // awaited once, move the result out instead of copying it
+                    return std::move(this->coro_.promise().result());
                 }
             }
         };
@@ -1,14 +1,22 @@
 #pragma once 
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
-#include <set>
+#include <mutex>
 #include <thread>
 #include <vector>
-#include <condition_variable>
+#include <functional>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
 
+#include "cpu_affinity.hpp"
 #include "task.hpp"
 #include "types.hpp"
-#include "mpmc_queue.hpp"
+#include "work_stealing_queue.hpp"
 #include "io_service_pool.hpp"
 
 namespace sheep {
@@ -18,100 +26,281 @@ namespace sheep {
 class thread_pool
 {
 public:
-    thread_pool(int n_threads, io_service_pool& ios_pool)
-        : session_queue_(1024)
-        , io_services_(ios_pool)
+    using init_fn = std::function<void(thread_meta)>;
+
+    thread_pool(int n_threads, io_service_pool& ios_pool, cpu_placement placement = {})
+        : io_services_(ios_pool)
+        , placement_(std::move(placement))
+        , run_queues_(n_threads)
+        , thread_local_coros_(n_threads)
     {
         assert(n_threads == ios_pool.size());
         work_threads_.reserve(n_threads);
-        thread_local_coros_.resize(n_threads);
+        for (auto& registry: thread_local_coros_)
+            registry.pool = this;
+        local_sessions_.resize(n_threads);
+        ready_coros_.resize(n_threads);
+        if (placement_.pinned())
+            map_cpus_to_workers(n_threads);
     }
 
     ~thread_pool() noexcept {
         stop_work_thread();
     }
 
+    /// queue a new session on one of the workers (round robin) and wake it
+    /// through its ring, even if it is blocked waiting for io.
     void submit(session_wrapper session) {
-        session_queue_.emplace(std::move(session));
-        avaliable_cv_.notify_one();
+        auto target = next_queue_.fetch_add(1, std::memory_order_relaxed) % run_queues_.size();
+        submit_to(target, std::move(session));
+    }
+
+    /// queue a new session on a given worker, e.g. the one pinned near the
+    /// connection's nic queue. idle neighbours may still steal it, unless
+    /// stealing is off.
+    void submit_to(std::size_t target, session_wrapper session) {
+        auto n = run_queues_.size();
+        assert(target < n);
+        live_.fetch_add(1, std::memory_order_relaxed);
+        run_queues_[target].push(std::move(session));
+        pending_.fetch_add(1, std::memory_order_release);
+        io_services_.get_io_service(thread_meta{static_cast<uint16_t>(target)}).notify();
+        // the target is backlogged, let its neighbour steal some of the work
+        if (stealing_ && n > 1 && run_queues_[target].size() > 1)
+            io_services_.get_io_service(thread_meta{static_cast<uint16_t>((target + 1) % n)}).notify();
+    }
+
+    /// whether idle workers take queued sessions of others, on by default.
+    /// e.g. off while every worker's connections are capped. call it before
+    /// start().
+    void set_stealing(bool enabled) noexcept { stealing_ = enabled; }
+
+    /// run a session on the calling worker thread, it never crosses threads.
+    /// must be called from a worker thread, e.g. by a per-worker acceptor.
+    void spawn(session_wrapper session) {
+        live_.fetch_add(1, std::memory_order_relaxed);
+        local_sessions_[this_thread().thread_id].push_back(session);
     }
 
-    void start() noexcept {
+    /// re-enqueue the calling coroutine behind the other runnable work of
+    /// this worker. must be awaited on a worker thread; the coroutine stays
+    /// on its ring because its connection and in-flight io are bound to it.
+    auto schedule() noexcept {
+        struct awaiter
+        {
+            thread_pool* pool_;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> coro) {
+                pool_->ready_coros_[pool_->this_thread().thread_id].push_back(coro);
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{this};
+    }
+
+    /// the worker pinned to `cpu`, or one on the same numa node.
+    /// -1 if workers aren't pinned.
+    int worker_for_cpu(int cpu) const noexcept {
+        if (cpu < 0 || static_cast<std::size_t>(cpu) >= worker_of_cpu_.size()) return -1;
+        return worker_of_cpu_[cpu];
+    }
+
+    const cpu_placement& placement() const noexcept { return placement_; }
+
+    /// start the workers, `on_start` runs on every worker thread before it
+    /// enters its event loop.
+    void start(init_fn on_start = nullptr) noexcept {
         for (uint16_t i=0; i<thread_local_coros_.size(); ++i) {
             work_threads_.emplace_back(
-                [this, i](auto stop_token) {
+                [this, i, on_start](auto stop_token) {
                     this_thread_ = thread_meta{i};
+                    if (placement_.pinned()) {
+                        int ret = pin_this_thread(placement_.worker_cpu(i));
+                        if (ret < 0)
+                            std::cerr << "Failed to pin worker " << i << ", reason: "
+                                      << std::strerror(-ret) << std::endl;
+                    }
+                    // single issuer rings are bound to the thread enabling them
+                    io_services_.get_io_service(this_thread_).enable_on_this_thread();
+                    if (on_start) on_start(this_thread_);
                     start_work_thread(stop_token);
                 }
             );
         }
     }
 
+    /// block the caller until all workers exit.
+    void join() noexcept {
+        for (auto& thr: work_threads_) {
+            if (thr.joinable())
+                thr.join();
+        }
+    }
+
+    /// stop the workers and wait for them to exit. sessions still alive are
+    /// left suspended, their io may still be in flight on the rings.
+    void stop() noexcept {
+        stop_work_thread();
+    }
+
+    /// sessions submitted or spawned and not finished yet, queued included
+    std::size_t live_sessions() const noexcept {
+        return live_.load(std::memory_order_acquire);
+    }
+
+    /// block the caller until every session finished or `deadline` passed.
+    /// \return true if no session is left.
+    bool wait_idle(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lk{idle_mutex_};
+        return idle_cv_.wait_until(lk, deadline, [this] { return live_sessions() == 0; });
+    }
+
 private:
-    std::set<std::coroutine_handle<>>& get_coro_list(thread_meta thread) noexcept {
+    struct session_registry
+    {
+        detail::promise_list coros;
+        thread_pool* pool{nullptr};
+    };
+
+    detail::promise_list& get_coro_list(thread_meta thread) noexcept {
         assert(thread.thread_id < thread_local_coros_.size());
-        return thread_local_coros_[thread.thread_id];
+        return thread_local_coros_[thread.thread_id].coros;
     }
 
-    std::set<std::coroutine_handle<>>& get_coro_list() noexcept {
+    detail::promise_list& get_coro_list() noexcept {
         return get_coro_list(this_thread());
     }
 
     thread_meta this_thread() noexcept { return this_thread_; }
 
+    /// cpu -> worker pinned on it, else a worker of the same numa node
+    void map_cpus_to_workers(std::size_t n_workers) {
+        std::size_t n_cpus = std::thread::hardware_concurrency();
+        for (std::size_t i=0; i<n_workers; ++i)
+            n_cpus = std::max<std::size_t>(n_cpus, placement_.worker_cpu(i) + 1);
+        std::map<int, int> worker_of_node;
+        for (std::size_t i=0; i<n_workers; ++i)
+            worker_of_node.emplace(numa_node_of_cpu(placement_.worker_cpu(i)), i);
+
+        worker_of_cpu_.assign(n_cpus, -1);
+        for (std::size_t cpu=0; cpu<n_cpus; ++cpu) {
+            auto it = worker_of_node.find(numa_node_of_cpu(cpu));
+            if (it != worker_of_node.end())
+                worker_of_cpu_[cpu] = it->second;
+        }
+        for (std::size_t i=0; i<n_workers; ++i)
+            worker_of_cpu_[placement_.worker_cpu(i)] = static_cast<int>(i);
+    }
+
+    /// final suspend hook of a session, unlink and free it in O(1)
+    static void reclaim_session(detail::task_promise_base& promise,
+        std::coroutine_handle<> coro, void* ctx) noexcept
+    {
+        auto registry = static_cast<session_registry*>(ctx);
+        registry->coros.erase(promise);
+        coro.destroy();
+        registry->pool->session_finished();
+    }
+
+    void session_finished() noexcept {
+        if (live_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        // wake wait_idle(), taking the lock so the wakeup can't be missed
+        std::lock_guard<std::mutex> g{idle_mutex_};
+        idle_cv_.notify_all();
+    }
+
+    void resume_session(session_wrapper& session) {
+        if (session.coro == nullptr) [[unlikely]] {
+            session_finished();
+            return;
+        }
+        if (session.conn != nullptr) {
+            session.conn->set_io_service(&io_services_.get_io_service(this_thread()));
+            session.conn->set_worker(this_thread().thread_id);
+        }
+        // register before resuming, the session may finish synchronously
+        auto& registry = thread_local_coros_[this_thread().thread_id];
+        auto& promise = session.coro.promise();
+        registry.coros.push_back(promise);
+        promise.set_completion(&thread_pool::reclaim_session, &registry);
+        session.coro.resume();
+    }
+
+    /// take half of the queued sessions of another worker
+    std::size_t steal_sessions(std::vector<session_wrapper>& out) {
+        auto self = this_thread().thread_id;
+        auto n = run_queues_.size();
+        for (std::size_t i=1; i<n; ++i) {
+            auto stolen = run_queues_[(self + i) % n].steal(out);
+            if (stolen > 0) return stolen;
+        }
+        return 0;
+    }
+
     void resume_coroutine() {
-        auto& coro_list = get_coro_list();
-        auto& ios = io_services_.get_io_service(this_thread());
-        session_wrapper session;
-        while (session_queue_.try_pop(session))
+        auto self = this_thread().thread_id;
+        // sessions spawned on this thread, resuming them may spawn more
+        auto& local = local_sessions_[self];
+        while (!local.empty())
+        {
+            std::vector<session_wrapper> batch;
+            batch.swap(local);
+            for (auto& session: batch)
+                resume_session(session);
+        }
+
+        // coroutines yielded by schedule()
+        auto& ready = ready_coros_[self];
+        if (!ready.empty())
         {
-            if (session.coro == nullptr) [[unlikely]] continue;
-            session.conn->set_io_service(&ios);
-            session.coro.resume();
-            if (!session.coro.done())
-                coro_list.insert(session.coro);
+            std::vector<std::coroutine_handle<>> batch;
+            batch.swap(ready);
+            for (auto coro: batch)
+                coro.resume();
+        }
+
+        std::size_t taken = 0;
+        session_wrapper session;
+        while (run_queues_[self].try_pop(session)) {
+            ++taken;
+            resume_session(session);
         }
+
+        if (taken == 0 && stealing_ && pending_.load(std::memory_order_acquire) > 0) {
+            std::vector<session_wrapper> stolen;
+            taken = steal_sessions(stolen);
+            for (auto& s: stolen)
+                resume_session(s);
+        }
+        if (taken > 0)
+            pending_.fetch_sub(taken, std::memory_order_release);
     }
 
     void start_work_thread(std::stop_token st) noexcept {
         auto& ios = io_services_.get_io_service(this_thread());
-        auto& coro_list = get_coro_list(this_thread());
+        auto& ready = ready_coros_[this_thread().thread_id];
+        // new work is signalled through the ring (see io_service::notify()),
+        // idle or not the worker always blocks in io_uring_enter
 
         while (!st.stop_requested())
         {
-            {
-                std::unique_lock<std::mutex> lk{idle_mutex_};
-                avaliable_cv_.wait(lk, [this](){
-                    return !session_queue_.empty() || request_stop_;
-                });
-            }
-
             resume_coroutine();
-
-            while (!coro_list.empty())
-            {
-                // resume coroutine which io is ready
-                ios.wait_io_and_resume_coroutine();
-                for (auto it = coro_list.begin(); it != coro_list.end(); ) {
-                    if (it->done()) {
-                        it->destroy();
-                        it = coro_list.erase(it);
-                    } else {
-                        ++it;
-                    }
-                }
-                // resume coroutine submitted by user
-                resume_coroutine();
-            }
+            // resume coroutine which io is ready, finished sessions unlink
+            // themselves. only poll the ring while yielded coroutines are runnable.
+            // run_once() first runs the batch hooks, which flush the writes
+            // the batch above queued on its connections
+            ios.wait_io_and_resume_coroutine(ready.empty() ? 1 : 0);
         }
     }
 
     void stop_work_thread() noexcept {
-        request_stop_ = true;
         for (auto& thr: work_threads_) 
             thr.request_stop();
 
-        avaliable_cv_.notify_all();
+        for (std::size_t i=0; i<work_threads_.size(); ++i)
+            io_services_.get_io_service(thread_meta{static_cast<uint16_t>(i)}).notify();
         for (auto& thr: work_threads_) {
             if (thr.joinable())
                 thr.join();
@@ -120,13 +309,20 @@ private:
 
     inline static thread_local thread_meta this_thread_;
     io_service_pool& io_services_;
+    cpu_placement placement_;
+    std::vector<int> worker_of_cpu_;
     std::vector<std::jthread> work_threads_;
-    MPMCQueue<session_wrapper> session_queue_;
-    std::vector<std::set<std::coroutine_handle<>>> thread_local_coros_;
+    std::vector<work_stealing_queue<session_wrapper>> run_queues_;
+    std::vector<session_registry> thread_local_coros_;
+    std::vector<std::vector<session_wrapper>> local_sessions_;
+    std::vector<std::vector<std::coroutine_handle<>>> ready_coros_;
 
-    bool request_stop_{false};
-    std::condition_variable avaliable_cv_;
+    bool stealing_{true};
+    std::atomic<std::size_t> next_queue_{0};
+    std::atomic<std::size_t> pending_{0};
+    std::atomic<std::size_t> live_{0};
     std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
 };
 
 
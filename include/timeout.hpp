@@ -1,6 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <coroutine>
+#include <optional>
+#include <stop_token>
 #include <linux/time_types.h>
 
 #include "io_service.hpp"
@@ -8,14 +12,8 @@
 namespace sheep
 {
 
-template <typename Rep, typename Period>
-constexpr __kernel_timespec duration_to_timespec(std::chrono::duration<Rep, Period> duration) {
-    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration);
-    duration -= seconds;
-    auto nanosecs = std::chrono::duration_cast<std::chrono::nanoseconds>(duration);
-    return __kernel_timespec{seconds.count(), nanosecs.count()};
-}
-
+/// a single IORING_OP_TIMEOUT, one sqe per wait. prefer sleep_for() or a
+/// deadline_timer when many timers are armed and reset.
 struct timeout_duration
 {
     template <typename Rep, typename Period>
@@ -34,6 +32,127 @@ struct timeout_duration
 };
 
 
+/// suspend the coroutine on the timer wheel of `ios` until `when`, or until
+/// a stop is requested on `token` (from any thread), whichever comes first.
+/// destroying the suspended coroutine disarms the timer.
+struct [[nodiscard]] sleep_awaitable : timer_node
+{
+    sleep_awaitable(io_service& s, io_service::clock::time_point when,
+                    std::stop_token token = {}) noexcept
+        : ios(&s), deadline(when), stop(std::move(token))
+    {
+        on_expire = &sleep_awaitable::wake;
+    }
+
+    sleep_awaitable(const sleep_awaitable&) = delete;
+    sleep_awaitable& operator=(const sleep_awaitable&) = delete;
+
+    ~sleep_awaitable() noexcept { ios->cancel_timer(*this); }
+
+    bool await_ready() const noexcept {
+        return deadline <= io_service::clock::now() || stop.stop_requested();
+    }
+
+    void await_suspend(std::coroutine_handle<> coro_handle) noexcept {
+        coro = coro_handle;
+        ios->arm_timer(*this, deadline);
+        if (stop.stop_possible())
+            stop_callback.emplace(stop, stopper{this});
+    }
+
+    /// \return false if the sleep was cut short by a stop request
+    bool await_resume() noexcept {
+        // waits for a callback running on another thread
+        stop_callback.reset();
+        return state.load(std::memory_order_acquire) != kSTOPPED && !stop.stop_requested();
+    }
+
+    // the timer and the stop callback race to resume the coroutine
+    static constexpr int kWAITING = 0, kEXPIRED = 1, kSTOPPED = 2;
+
+    static void wake(timer_node* node) noexcept {
+        auto self = static_cast<sleep_awaitable*>(node);
+        if (self->state.exchange(kEXPIRED, std::memory_order_acq_rel) == kWAITING)
+            self->coro.resume();
+    }
+
+    struct stopper
+    {
+        sleep_awaitable* self;
+        void operator()() noexcept {
+            // the timer stays armed until the coroutine is back on its ring
+            if (self->state.exchange(kSTOPPED, std::memory_order_acq_rel) == kWAITING)
+                self->ios->post(self->coro);
+        }
+    };
+
+    io_service* ios;
+    io_service::clock::time_point deadline;
+    std::stop_token stop;
+    std::coroutine_handle<> coro;
+    std::atomic<int> state{kWAITING};
+    std::optional<std::stop_callback<stopper>> stop_callback;
+};
+
+inline sleep_awaitable sleep_until(io_service& ios, io_service::clock::time_point when,
+                                   std::stop_token token = {}) noexcept {
+    return sleep_awaitable{ios, when, std::move(token)};
+}
+
+template <typename Rep, typename Period>
+sleep_awaitable sleep_for(io_service& ios, std::chrono::duration<Rep, Period> duration,
+                          std::stop_token token = {}) noexcept {
+    return sleep_awaitable{ios, io_service::clock::now() +
+        std::chrono::duration_cast<io_service::clock::duration>(duration), std::move(token)};
+}
+
+
+/// a resettable deadline on the timer wheel of an io_service, e.g. the idle
+/// timeout of a connection. arming, resetting and cancelling are O(1), so it
+/// may be pushed back on every read. `fn(ctx)` runs on the ring's thread.
+class deadline_timer : private timer_node
+{
+public:
+    using callback = void (*)(void*) noexcept;
+
+    deadline_timer(io_service& ios, callback fn, void* ctx) noexcept
+        : ios_(&ios), fn_(fn), ctx_(ctx)
+    {
+        on_expire = &deadline_timer::fire;
+    }
+
+    deadline_timer(const deadline_timer&) = delete;
+    deadline_timer& operator=(const deadline_timer&) = delete;
+
+    ~deadline_timer() noexcept { cancel(); }
+
+    /// arm or push back the deadline
+    template <typename Rep, typename Period>
+    void expires_after(std::chrono::duration<Rep, Period> duration) noexcept {
+        expires_at(io_service::clock::now() +
+            std::chrono::duration_cast<io_service::clock::duration>(duration));
+    }
+
+    void expires_at(io_service::clock::time_point when) noexcept {
+        ios_->arm_timer(*this, when);
+    }
+
+    void cancel() noexcept { ios_->cancel_timer(*this); }
+
+    bool pending() const noexcept { return armed(); }
+
+private:
+    static void fire(timer_node* node) noexcept {
+        auto self = static_cast<deadline_timer*>(node);
+        self->fn_(self->ctx_);
+    }
+
+    io_service* ios_;
+    callback fn_;
+    void* ctx_;
+};
+
+
 
 
 }
\ No newline at end of file
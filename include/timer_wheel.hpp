@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace sheep {
+
+
+/// intrusive hook of a timer, owned by whoever embeds it (a coroutine frame,
+/// a connection...). it must stay at the same address while armed.
+struct timer_node
+{
+    timer_node* prev{nullptr};
+    timer_node* next{nullptr};
+    uint64_t expiry{0};  // absolute tick
+    uint16_t slot{0};    // level * kSLOTS + index, to keep the occupancy bitmap exact
+    void (*on_expire)(timer_node*) noexcept {nullptr};
+
+    bool armed() const noexcept { return prev != nullptr; }
+};
+
+
+// 分层时间轮：4层，每层256个槽，覆盖 2^32 个tick（1ms精度约49天）。
+// 第0层每个槽对应一个tick，第L层每个槽对应 256^L 个tick，
+// 高层的槽到期时把其中的定时器重新插入低层（cascade）。
+// 插入/重置/取消都是链表操作，O(1)；推进时间时跳过空槽，
+// 所以一直空闲的长超时（如keep-alive）几乎没有开销。
+// 非线程安全，只由驱动ring的线程使用。
+class timer_wheel
+{
+public:
+    static constexpr unsigned kLEVELS = 4;
+    static constexpr unsigned kSLOT_BITS = 8;
+    static constexpr unsigned kSLOTS = 1u << kSLOT_BITS;
+    static constexpr unsigned kMASK = kSLOTS - 1;
+    static constexpr uint64_t kMAX_DELTA = (uint64_t{1} << (kLEVELS * kSLOT_BITS)) - 1;
+
+    explicit timer_wheel(uint64_t now = 0) noexcept : now_(now) {
+        for (auto& level: levels_) {
+            for (auto& head: level.slots)
+                head.prev = head.next = &head;
+        }
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    /// arm `node` to expire on tick `expiry` (at least the next tick),
+    /// re-arming an armed node moves it.
+    void arm(timer_node& node, uint64_t expiry) noexcept {
+        if (node.armed())
+            unlink(node);
+        else
+            ++size_;
+        if (expiry <= now_)
+            expiry = now_ + 1;
+        else if (expiry - now_ > kMAX_DELTA)
+            expiry = now_ + kMAX_DELTA;
+        node.expiry = expiry;
+        insert(node);
+    }
+
+    /// disarm `node`, no-op if it isn't armed
+    void cancel(timer_node& node) noexcept {
+        if (!node.armed()) return;
+        unlink(node);
+        --size_;
+    }
+
+    /// move the wheel to tick `now`, running the callback of every timer
+    /// expiring on the way. callbacks may arm and cancel any timer.
+    /// \return number of expired timers.
+    std::size_t advance(uint64_t now) noexcept {
+        std::size_t fired = 0;
+        while (now_ < now) {
+            // skip the ticks on which nothing expires nor cascades
+            auto next = next_event();
+            if (next == 0 || next > now) {
+                now_ = now;
+                break;
+            }
+            now_ = next;
+            for (unsigned level = kLEVELS - 1; level > 0; --level) {
+                auto shift = level * kSLOT_BITS;
+                if ((now_ & ((uint64_t{1} << shift) - 1)) == 0)
+                    cascade(level, (now_ >> shift) & kMASK);
+            }
+            fired += expire(now_ & kMASK);
+        }
+        return fired;
+    }
+
+    /// the next tick on which a timer may expire, 0 if no timer is armed.
+    /// a tick on which a higher level only cascades counts as well, so the
+    /// caller may wake up early but never late.
+    uint64_t next_event() const noexcept {
+        if (size_ == 0) return 0;
+        uint64_t next = 0;
+        for (unsigned level = 0; level < kLEVELS; ++level) {
+            auto shift = level * kSLOT_BITS;
+            auto pos = now_ >> shift;
+            auto k = next_occupied(levels_[level], pos & kMASK);
+            if (k == 0) continue;
+            auto tick = (pos + k) << shift;
+            if (next == 0 || tick < next)
+                next = tick;
+        }
+        return next;
+    }
+
+    uint64_t now() const noexcept { return now_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+private:
+    struct level
+    {
+        std::array<timer_node, kSLOTS> slots;
+        std::array<uint64_t, kSLOTS / 64> occupied{};
+    };
+
+    void insert(timer_node& node) noexcept {
+        auto delta = node.expiry - now_;
+        unsigned level = 0;
+        while (level + 1 < kLEVELS && delta >= (uint64_t{1} << ((level + 1) * kSLOT_BITS)))
+            ++level;
+        auto index = static_cast<unsigned>((node.expiry >> (level * kSLOT_BITS)) & kMASK);
+        auto& head = levels_[level].slots[index];
+        node.slot = static_cast<uint16_t>(level * kSLOTS + index);
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+        levels_[level].occupied[index / 64] |= uint64_t{1} << (index % 64);
+    }
+
+    void unlink(timer_node& node) noexcept {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+        auto& lv = levels_[node.slot / kSLOTS];
+        auto index = node.slot % kSLOTS;
+        auto& head = lv.slots[index];
+        if (head.next == &head)
+            lv.occupied[index / 64] &= ~(uint64_t{1} << (index % 64));
+    }
+
+    /// detach the whole list of a slot, the slot is empty afterwards
+    void take(unsigned level, unsigned index, timer_node& list) noexcept {
+        auto& head = levels_[level].slots[index];
+        list.prev = list.next = &list;
+        if (head.next != &head) {
+            list.next = head.next;
+            list.prev = head.prev;
+            list.next->prev = &list;
+            list.prev->next = &list;
+            head.prev = head.next = &head;
+        }
+        levels_[level].occupied[index / 64] &= ~(uint64_t{1} << (index % 64));
+    }
+
+    void cascade(unsigned level, unsigned index) noexcept {
+        timer_node list;
+        take(level, index, list);
+        while (list.next != &list) {
+            auto node = list.next;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            insert(*node);
+        }
+    }
+
+    std::size_t expire(unsigned index) noexcept {
+        timer_node list;
+        take(0, index, list);
+        std::size_t fired = 0;
+        // a callback may cancel a timer still in `list`, it is unlinked from
+        // there like from any slot
+        while (list.next != &list) {
+            auto node = list.next;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            node->prev = node->next = nullptr;
+            --size_;
+            ++fired;
+            node->on_expire(node);
+        }
+        return fired;
+    }
+
+    /// distance (1..kSLOTS) from slot `pos` to the next occupied slot of
+    /// `lv`, going round the wheel once. 0 if the level is empty.
+    static uint64_t next_occupied(const level& lv, uint64_t pos) noexcept {
+        for (uint64_t k = 1; k <= kSLOTS; ) {
+            auto index = (pos + k) & kMASK;
+            auto word = lv.occupied[index / 64] >> (index % 64);
+            if (word != 0) {
+                auto d = static_cast<uint64_t>(std::countr_zero(word));
+                return k + d <= kSLOTS ? k + d : 0;
+            }
+            k += 64 - index % 64;
+        }
+        return 0;
+    }
+
+    std::array<level, kLEVELS> levels_;
+    uint64_t now_;
+    std::size_t size_{0};
+};
+
+
+}
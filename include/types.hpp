@@ -3,6 +3,7 @@
 #include <coroutine>
 #include <atomic>
 
+#include "task.hpp"
 #include "net/connection.hpp"
 
 namespace sheep {
@@ -18,7 +19,7 @@ struct thread_meta
 
 struct session_wrapper
 {
-    std::coroutine_handle<> coro;
+    task<>::coroutine_handle coro;
     net::Connection* conn;
 };
 
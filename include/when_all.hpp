@@ -0,0 +1,327 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "task.hpp"
+
+namespace sheep {
+
+
+namespace detail {
+
+
+template <typename T>
+using non_void_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+
+// 子协程没有continuation，结束时走task_promise_base的completion回调：
+// 计数减一，最后一个结束的子协程恢复父协程。父协程在启动全部子协程期间
+// 额外持有一个计数，所以同步完成的子协程不会在启动过程中恢复父协程。
+struct join_state
+{
+    static constexpr std::size_t kNONE = static_cast<std::size_t>(-1);
+
+    std::atomic<std::size_t> remaining{0};
+    // index of the when_any winner, or of the first child that failed
+    std::atomic<std::size_t> first{kNONE};
+    std::coroutine_handle<> parent;
+    std::stop_source* stop{nullptr}; // stop requested when `first` is set
+    bool first_wins{false};          // when_any: any completion sets `first`
+};
+
+struct join_entry
+{
+    std::coroutine_handle<> coro;
+    task_promise_base* promise{nullptr};
+    join_state* state{nullptr};
+    std::size_t index{0};
+
+    template <typename T>
+    static join_entry of(const task<T>& t) noexcept {
+        auto h = t.handle();
+        return join_entry{h, h ? &h.promise() : nullptr};
+    }
+};
+
+inline void on_child_done(task_promise_base& promise, std::coroutine_handle<>, void* ctx) noexcept {
+    auto entry = static_cast<join_entry*>(ctx);
+    auto state = entry->state;
+    if (state->first_wins || promise.failed()) {
+        auto none = join_state::kNONE;
+        if (state->first.compare_exchange_strong(none, entry->index) && state->stop)
+            state->stop->request_stop();
+    }
+    if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        state->parent.resume();
+}
+
+/// start every child and resume the awaiting coroutine once all finished
+struct join_awaitable
+{
+    join_state& state_;
+    std::span<join_entry> entries_;
+
+    bool await_ready() const noexcept { return entries_.empty(); }
+
+    bool await_suspend(std::coroutine_handle<> parent) noexcept {
+        state_.parent = parent;
+        state_.remaining.store(entries_.size() + 1, std::memory_order_relaxed);
+        for (std::size_t i=0; i<entries_.size(); ++i) {
+            auto& e = entries_[i];
+            e.state = &state_;
+            e.index = i;
+            if (!e.coro) {
+                state_.remaining.fetch_sub(1, std::memory_order_relaxed);
+                continue;
+            }
+            e.promise->set_completion(&on_child_done, &e);
+            e.coro.resume();
+        }
+        // every child finished synchronously, carry on without suspending
+        return state_.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+
+    void await_resume() const noexcept {}
+};
+
+template <typename T>
+non_void_t<T> take_result(task<T>& t) {
+    if constexpr (std::is_void_v<T>) {
+        t.handle().promise().result();
+        return {};
+    } else {
+        return std::move(t.handle().promise().result());
+    }
+}
+
+template <typename... Ts>
+task<std::tuple<non_void_t<Ts>...>> when_all_impl(std::stop_source* stop, task<Ts>... tasks) {
+    join_state state;
+    state.stop = stop;
+    std::array<join_entry, sizeof...(Ts)> entries{join_entry::of(tasks)...};
+    co_await join_awaitable{state, entries};
+    // braced init evaluates left to right: the first failed argument throws
+    co_return std::tuple<non_void_t<Ts>...>{take_result(tasks)...};
+}
+
+template <typename T>
+task<std::vector<non_void_t<T>>> when_all_impl(std::stop_source* stop, std::vector<task<T>> tasks) {
+    join_state state;
+    state.stop = stop;
+    std::vector<join_entry> entries;
+    entries.reserve(tasks.size());
+    for (auto& t: tasks)
+        entries.push_back(join_entry::of(t));
+    co_await join_awaitable{state, entries};
+    std::vector<non_void_t<T>> results;
+    results.reserve(tasks.size());
+    for (auto& t: tasks)
+        results.push_back(take_result(t));
+    co_return results;
+}
+
+
+} // namespace detail
+
+
+/// run the tasks concurrently and wait for all of them.
+/// \return the results in argument order, void tasks yield std::monostate.
+/// rethrows the exception of the first failed task (in argument order).
+template <typename... Ts>
+task<std::tuple<detail::non_void_t<Ts>...>> when_all(task<Ts>... tasks) {
+    return detail::when_all_impl(nullptr, std::move(tasks)...);
+}
+
+/// same as above, but the first failure requests a stop on `stop` so that
+/// the siblings observing its token (e.g. io_awaitable::cancel_on) bail out.
+template <typename... Ts>
+task<std::tuple<detail::non_void_t<Ts>...>> when_all(std::stop_source stop, task<Ts>... tasks) {
+    auto results = co_await detail::when_all_impl(&stop, std::move(tasks)...);
+    co_return results;
+}
+
+template <typename T>
+task<std::vector<detail::non_void_t<T>>> when_all(std::vector<task<T>> tasks) {
+    return detail::when_all_impl(nullptr, std::move(tasks));
+}
+
+template <typename T>
+task<std::vector<detail::non_void_t<T>>> when_all(std::stop_source stop, std::vector<task<T>> tasks) {
+    auto results = co_await detail::when_all_impl(&stop, std::move(tasks));
+    co_return results;
+}
+
+
+template <typename T>
+struct when_any_result
+{
+    std::size_t index;
+    T value;
+};
+
+template <>
+struct when_any_result<void>
+{
+    std::size_t index;
+};
+
+/// run the tasks concurrently, the first to finish wins and a stop is
+/// requested on `stop`: the losers are expected to observe its token (e.g.
+/// recv().cancel_on(token), sleep_for(ios, d, token)) and return early.
+/// all tasks have finished when this returns, none is left running.
+/// rethrows the exception of the winner.
+/// \throw std::invalid_argument if `tasks` is empty, there is no winner.
+template <typename T>
+task<when_any_result<T>> when_any(std::stop_source stop, std::vector<task<T>> tasks) {
+    if (tasks.empty())
+        throw std::invalid_argument("when_any: no tasks!");
+    detail::join_state state;
+    state.stop = &stop;
+    state.first_wins = true;
+    std::vector<detail::join_entry> entries;
+    entries.reserve(tasks.size());
+    for (auto& t: tasks)
+        entries.push_back(detail::join_entry::of(t));
+    co_await detail::join_awaitable{state, entries};
+
+    auto index = state.first.load(std::memory_order_acquire);
+    if constexpr (std::is_void_v<T>) {
+        tasks[index].handle().promise().result();
+        co_return when_any_result<void>{index};
+    } else {
+        co_return when_any_result<T>{index, std::move(tasks[index].handle().promise().result())};
+    }
+}
+
+template <typename T, typename... Rest>
+    requires (std::same_as<T, Rest> && ...)
+task<when_any_result<T>> when_any(std::stop_source stop, task<T> first, task<Rest>... rest) {
+    std::vector<task<T>> tasks;
+    tasks.reserve(1 + sizeof...(Rest));
+    tasks.push_back(std::move(first));
+    (tasks.push_back(std::move(rest)), ...);
+    co_return co_await when_any(std::move(stop), std::move(tasks));
+}
+
+
+/// a nursery for a dynamic number of child tasks: children start as soon as
+/// they are spawned, join() waits for all of them. the first child to fail
+/// requests a stop on the group's token, so its siblings can cancel their io,
+/// and join() rethrows that exception. a group must be joined before it is
+/// destroyed, and spawn() must not be called while join() is pending.
+class task_group
+{
+public:
+    task_group() = default;
+    explicit task_group(std::stop_source stop) noexcept : stop_(std::move(stop)) {}
+    task_group(const task_group&) = delete;
+    task_group& operator=(const task_group&) = delete;
+
+    ~task_group() noexcept {
+        // destroying a running child would leave its io dangling
+        assert(running_.load(std::memory_order_relaxed) == 0);
+    }
+
+    /// hand to children so they can observe cancellation
+    std::stop_token token() const noexcept { return stop_.get_token(); }
+
+    /// cancel all children
+    void cancel() noexcept { stop_.request_stop(); }
+
+    void spawn(task<> t) {
+        auto h = t.handle();
+        if (!h) return;
+        auto& c = children_.emplace_back(child{std::move(t), this, children_.size()});
+        running_.fetch_add(1, std::memory_order_relaxed);
+        h.promise().set_completion(&task_group::on_done, &c);
+        h.resume();
+    }
+
+    /// wait until every spawned child finished, then release them
+    auto join() noexcept {
+        struct awaiter
+        {
+            task_group* group_;
+
+            bool await_ready() const noexcept {
+                return group_->running_.load(std::memory_order_acquire) == 0;
+            }
+            bool await_suspend(std::coroutine_handle<> parent) noexcept {
+                group_->parent_ = parent;
+                group_->joining_.store(true);
+                if (group_->running_.load() != 0)
+                    return true;
+                // the last child finished on another thread in between. if it
+                // saw the flag it resumes us, else take the flag back and go on
+                bool waiting = true;
+                return !group_->joining_.compare_exchange_strong(waiting, false);
+            }
+            void await_resume() { group_->finish(); }
+        };
+        return awaiter{this};
+    }
+
+    std::size_t size() const noexcept { return children_.size(); }
+
+private:
+    struct child
+    {
+        task<> t;
+        task_group* group;
+        std::size_t index;
+    };
+
+    static void on_done(detail::task_promise_base& promise, std::coroutine_handle<>, void* ctx) noexcept {
+        auto c = static_cast<child*>(ctx);
+        auto group = c->group;
+        if (promise.failed()) {
+            auto none = detail::join_state::kNONE;
+            if (group->failed_.compare_exchange_strong(none, c->index))
+                group->stop_.request_stop();
+        }
+        if (group->running_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        // the last child resumes join() if one is suspended, and clears the
+        // flag so the group can be spawned into and joined again
+        bool waiting = true;
+        if (group->joining_.compare_exchange_strong(waiting, false))
+            group->parent_.resume();
+    }
+
+    void finish() {
+        auto failed = failed_.exchange(detail::join_state::kNONE);
+        std::exception_ptr error;
+        if (failed != detail::join_state::kNONE) {
+            try { children_[failed].t.handle().promise().result(); }
+            catch (...) { error = std::current_exception(); }
+        }
+        children_.clear();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    std::stop_source stop_;
+    std::deque<child> children_; // stable addresses, the completion hook points here
+    std::atomic<std::size_t> running_{0};
+    std::atomic<std::size_t> failed_{detail::join_state::kNONE};
+    // set while join() is suspended; seq_cst with running_, see await_suspend
+    std::atomic<bool> joining_{false};
+    std::coroutine_handle<> parent_;
+};
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace sheep {
+
+
+// 每个工作线程拥有一个队列：
+// 所属线程从队头取出（先进先出，先accept的连接先处理），
+// 空闲线程从队尾窃取，最多窃取一半，避免和所属线程争抢同一端。
+// 队列只在入队/出队/窃取时短暂持锁，竞争只发生在窃取时。
+template <typename T>
+class work_stealing_queue
+{
+public:
+    work_stealing_queue() = default;
+    work_stealing_queue(const work_stealing_queue&) = delete;
+    work_stealing_queue& operator=(const work_stealing_queue&) = delete;
+
+    void push(T v) {
+        std::lock_guard<std::mutex> g{mutex_};
+        items_.push_back(std::move(v));
+        size_.store(items_.size(), std::memory_order_relaxed);
+    }
+
+    bool try_pop(T& v) {
+        if (empty()) return false;
+        std::lock_guard<std::mutex> g{mutex_};
+        if (items_.empty()) return false;
+        v = std::move(items_.front());
+        items_.pop_front();
+        size_.store(items_.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    /// move up to half of the queued items (at least one) into `out`
+    /// \return number of items stolen
+    std::size_t steal(std::vector<T>& out) {
+        if (empty()) return 0;
+        std::unique_lock<std::mutex> lk{mutex_, std::try_to_lock};
+        // the owner or another thief is working on it, try someone else
+        if (!lk.owns_lock() || items_.empty()) return 0;
+        auto n = (items_.size() + 1) / 2;
+        for (std::size_t i=0; i<n; ++i) {
+            out.push_back(std::move(items_.back()));
+            items_.pop_back();
+        }
+        size_.store(items_.size(), std::memory_order_relaxed);
+        return n;
+    }
+
+    /// approximate size, may be stale when read by other threads
+    std::size_t size() const noexcept { return size_.load(std::memory_order_relaxed); }
+    bool empty() const noexcept { return size() == 0; }
+
+private:
+    std::mutex mutex_;
+    std::deque<T> items_;
+    alignas(64) std::atomic<std::size_t> size_{0};
+};
+
+
+}
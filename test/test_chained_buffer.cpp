@@ -0,0 +1,209 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <sys/uio.h>
+
+#include "chained_buffer.hpp"
+
+using namespace sheep;
+
+constexpr std::size_t kSEG = chained_buffer::kSEGMENT_SIZE;
+constexpr std::ptrdiff_t kBLOCK = detail::segment_pool::kBLOCK_SIZE;
+
+// `n` bytes of a repeating pattern, so misplaced bytes show up
+std::string pattern(std::size_t n, char first = 'a') {
+    std::string s(n, '\0');
+    for (std::size_t i=0; i<n; ++i)
+        s[i] = static_cast<char>(first + i % 26);
+    return s;
+}
+
+// a needle split across two and three segments is found
+void test_find_across_segments() {
+    chained_buffer buf;
+    std::string head(kSEG - 2, '.');
+    buf.append(head);
+    buf.append("\r\n\r\n");
+    assert(buf.segments() == 2);
+    assert(buf.find("\r\n\r\n") == kSEG - 2);
+    assert(buf.find("\r\n", kSEG - 1) == kSEG);
+    assert(buf.find("\n\r\n") == kSEG - 1);
+    assert(buf.find("\r\n\r\n\r") == chained_buffer::npos);
+    assert(buf.find("") == 0);
+    assert(buf.find("", buf.size() + 1) == chained_buffer::npos);
+
+    // longer than one segment
+    chained_buffer big;
+    auto body = pattern(3 * kSEG);
+    body[kSEG - 10] = '#';
+    big.append(body);
+    auto needle = body.substr(kSEG - 10, kSEG + 20);
+    assert(big.find(needle) == kSEG - 10);
+
+    // a partial match at a segment's end must not hide a later one
+    chained_buffer partial;
+    partial.append(std::string(kSEG - 1, '.') + "\r.\r\n");
+    assert(partial.find("\r\n") == kSEG + 1);
+}
+
+// find stays relative to the readable bytes after consume
+void test_find_after_consume() {
+    chained_buffer buf;
+    buf.append(std::string(kSEG + 100, 'x'));
+    buf.append("END");
+    buf.consume(kSEG - 5);
+    assert(buf.segments() == 2);
+    assert(buf.find("END") == 105);
+    buf.consume(105);
+    assert(buf.segments() == 1);
+    assert(buf.find("END") == 0);
+}
+
+// peek copies across segments from any offset without consuming
+void test_peek_across_segments() {
+    chained_buffer buf;
+    auto data = pattern(2 * kSEG + 17);
+    buf.append(data);
+    std::string out(64, '\0');
+    assert(buf.peek(out.data(), 64, kSEG - 32) == 64);
+    assert(out == data.substr(kSEG - 32, 64));
+    assert(buf.peek(out.data(), 64, data.size() - 10) == 10);
+    assert(out.compare(0, 10, data, data.size() - 10, 10) == 0);
+    assert(buf.peek(out.data(), 64, data.size()) == 0);
+    assert(buf.size() == data.size());
+    assert(buf.to_string() == data);
+}
+
+// consume frees emptied segments but keeps the one being filled
+void test_consume_frees_segments() {
+    chained_buffer buf;
+    auto data = pattern(3 * kSEG);
+    buf.append(data);
+    assert(buf.segments() == 3);
+    assert(buf.consume(kSEG + 1) == kSEG + 1);
+    assert(buf.segments() == 2);
+    assert(buf.to_string() == data.substr(kSEG + 1));
+    assert(buf.consume(10 * kSEG) == 2 * kSEG - 1);
+    assert(buf.empty() && buf.segments() == 0);
+
+    // the partly filled tail stays for reuse
+    buf.append("abc");
+    assert(buf.consume(3) == 3);
+    assert(buf.segments() == 1 && buf.spare() == kSEG);
+    buf.append("def");
+    assert(buf.segments() == 1 && buf.to_string() == "def");
+}
+
+// prepare/commit spread bytes over several segments as one recvmsg would
+void test_prepare_commit() {
+    chained_buffer buf;
+    buf.append("xy");
+    iovec iov[chained_buffer::kMAX_IOVECS];
+    auto n = buf.prepare(iov, 2 * kSEG);
+    assert(n == 3);
+    assert(iov[0].iov_len == kSEG - 2);
+    auto data = pattern(kSEG + 5);
+    std::size_t off = 0;
+    for (std::size_t i=0; i<n && off<data.size(); ++i) {
+        auto k = std::min(iov[i].iov_len, data.size() - off);
+        std::memcpy(iov[i].iov_base, data.data() + off, k);
+        off += k;
+    }
+    buf.commit(data.size());
+    assert(buf.to_string() == "xy" + data);
+    iovec out[chained_buffer::kMAX_IOVECS];
+    assert(buf.data_iovecs(out) == 2);
+    assert(out[0].iov_len + out[1].iov_len == buf.size());
+}
+
+// appending a buffer drops our spare segments, so its bytes follow ours
+void test_append_trims_spare() {
+    chained_buffer a;
+    a.append("head");
+    iovec iov[chained_buffer::kMAX_IOVECS];
+    a.prepare(iov, 3 * kSEG); // spare segments behind the data
+    assert(a.segments() == 4);
+
+    chained_buffer b;
+    auto tail = pattern(kSEG + 3, 'A');
+    tail[kSEG - 2] = '#'; // spans b's two segments
+    b.append(tail);
+    a.append(std::move(b));
+    assert(b.empty() && b.segments() == 0);
+    assert(a.size() == 4 + tail.size());
+    assert(a.to_string() == "head" + tail);
+    assert(a.segments() == 3); // head's segment + b's two
+    assert(a.find("headABC") == 0);
+    assert(a.find(tail.substr(kSEG - 2, 5)) == 4 + kSEG - 2);
+
+    // a full last segment with an empty spare one behind it
+    chained_buffer c;
+    c.append(pattern(kSEG));
+    c.prepare(iov, 1);
+    assert(c.segments() == 2);
+    chained_buffer d;
+    d.append("tail");
+    c.append(std::move(d));
+    assert(c.segments() == 2);
+    assert(c.to_string() == pattern(kSEG) + "tail");
+
+    // more appends go after the adopted bytes
+    c.append("!");
+    assert(c.to_string() == pattern(kSEG) + "tail!");
+}
+
+struct budget
+{
+    std::ptrdiff_t bytes{0};
+
+    static void charge(void* ctx, std::ptrdiff_t n) noexcept {
+        static_cast<budget*>(ctx)->bytes += n;
+    }
+};
+
+// segment memory is charged to the account holding it, and moves with it
+void test_accounting() {
+    budget x, y;
+    {
+        chained_buffer a;
+        a.append(pattern(kSEG + 1));
+        a.set_account(&budget::charge, &x);
+        assert(x.bytes == 2 * kBLOCK);
+        a.append(pattern(kSEG));
+        assert(x.bytes == 3 * kBLOCK);
+        a.consume(kSEG);
+        assert(x.bytes == 2 * kBLOCK);
+
+        chained_buffer b;
+        b.set_account(&budget::charge, &y);
+        b.append("yy");
+        iovec iov[chained_buffer::kMAX_IOVECS];
+        b.prepare(iov, kSEG);
+        assert(y.bytes == 2 * kBLOCK);
+        b.append(std::move(a));
+        assert(x.bytes == 0);
+        assert(y.bytes == 3 * kBLOCK); // b's spare segment was freed
+
+        chained_buffer c{std::move(b)};
+        assert(y.bytes == 3 * kBLOCK);
+        c.set_account(nullptr, nullptr);
+        assert(y.bytes == 0);
+        c.set_account(&budget::charge, &x);
+        assert(x.bytes == 3 * kBLOCK);
+    }
+    assert(x.bytes == 0 && y.bytes == 0);
+}
+
+int main() {
+    test_find_across_segments();
+    test_find_after_consume();
+    test_peek_across_segments();
+    test_consume_frees_segments();
+    test_prepare_commit();
+    test_append_trims_spare();
+    test_accounting();
+    std::cout << "test_chained_buffer passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,122 @@
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+#include "slab_pool.hpp"
+
+using namespace sheep;
+using detail::slab_pool;
+
+// whether the page at `p` is still mapped
+bool mapped(void* p) {
+    return ::msync(p, 4096, MS_ASYNC) == 0 || errno != ENOMEM;
+}
+
+void* slab_of(void* p) {
+    return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(p) & ~(detail::kSLAB_SIZE - 1));
+}
+
+// a freed block is the next one handed out on the same thread
+void test_local_reuse() {
+    using pool = slab_pool<64>;
+    auto a = pool::allocate();
+    auto b = pool::allocate();
+    assert(a != b);
+    pool::deallocate(a);
+    assert(pool::allocate() == a);
+    pool::deallocate(a);
+    pool::deallocate(b);
+}
+
+// blocks freed by another thread go back to the owner and are reused there
+void test_remote_free_returns_to_owner() {
+    using pool = slab_pool<128>;
+    std::vector<void*> blocks;
+    for (int i=0; i<1000; ++i)
+        blocks.push_back(pool::allocate());
+    std::set<void*> owned(blocks.begin(), blocks.end());
+
+    std::thread([&] {
+        for (auto p: blocks) pool::deallocate(p);
+    }).join();
+
+    // the local free list is empty, so the remote ones are taken back
+    for (int i=0; i<1000; ++i) {
+        auto p = pool::allocate();
+        assert(owned.count(p) == 1);
+        blocks[i] = p;
+    }
+    for (auto p: blocks) pool::deallocate(p);
+}
+
+// the pool of an exited thread lives until its last block is freed, then
+// its slabs are unmapped
+void test_remote_free_after_owner_exits() {
+    using pool = slab_pool<192>;
+    std::vector<void*> blocks;
+    std::thread([&] {
+        for (int i=0; i<100; ++i) {
+            auto p = pool::allocate();
+            std::memset(p, i, 192);
+            blocks.push_back(p);
+        }
+    }).join();
+
+    auto slab = slab_of(blocks[0]);
+    for (auto p: blocks)
+        assert(slab_of(p) == slab);
+    for (int i=0; i<100; ++i)
+        assert(static_cast<unsigned char*>(blocks[i])[191] == i);
+
+    for (int i=0; i<99; ++i)
+        pool::deallocate(blocks[i]);
+    assert(mapped(slab));
+    pool::deallocate(blocks[99]);
+    assert(!mapped(slab));
+}
+
+// many threads freeing remotely while the owner keeps allocating
+void test_concurrent_remote_free() {
+    using pool = slab_pool<256>;
+    constexpr int kTHREADS = 4;
+    constexpr int kROUNDS = 50;
+    constexpr int kBLOCKS = 512;
+    for (int round=0; round<kROUNDS; ++round) {
+        std::vector<std::vector<void*>> parts(kTHREADS);
+        for (int i=0; i<kBLOCKS; ++i) {
+            auto p = pool::allocate();
+            std::memset(p, 0xab, 256);
+            parts[i % kTHREADS].push_back(p);
+        }
+        std::vector<std::thread> freers;
+        for (auto& part: parts)
+            freers.emplace_back([&part] {
+                for (auto p: part) pool::deallocate(p);
+            });
+        // allocate from the remote list while it is being pushed to
+        std::vector<void*> mine;
+        for (int i=0; i<kBLOCKS; ++i)
+            mine.push_back(pool::allocate());
+        for (auto& t: freers) t.join();
+        std::sort(mine.begin(), mine.end());
+        assert(std::adjacent_find(mine.begin(), mine.end()) == mine.end());
+        for (auto p: mine) pool::deallocate(p);
+    }
+}
+
+int main() {
+    test_local_reuse();
+    test_remote_free_returns_to_owner();
+    test_remote_free_after_owner_exits();
+    test_concurrent_remote_free();
+    std::cout << "test_slab_pool passed" << std::endl;
+    return 0;
+}
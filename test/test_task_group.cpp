@@ -0,0 +1,163 @@
+#undef NDEBUG
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "when_all.hpp"
+
+using namespace sheep;
+
+// a child parks here until the test resumes it, like one waiting on io
+struct gate
+{
+    std::coroutine_handle<> waiter;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { waiter = h; }
+    void await_resume() const noexcept {}
+
+    void open() { std::exchange(waiter, nullptr).resume(); }
+};
+
+task<> quick(int& done) {
+    ++done;
+    co_return;
+}
+
+task<> parked(gate& g, int& done) {
+    co_await g;
+    ++done;
+}
+
+task<> failing() {
+    throw std::runtime_error("child failed");
+    co_return;
+}
+
+task<> spawn_quick_and_join(task_group& group, int& done, int& joins) {
+    group.spawn(quick(done));
+    group.spawn(quick(done));
+    co_await group.join();
+    ++joins;
+}
+
+// children that finish inside spawn() must not resume a join that isn't there
+void test_synchronous_children() {
+    task_group group;
+    int done = 0, joins = 0;
+    auto parent = spawn_quick_and_join(group, done, joins);
+    parent.resume();
+    assert(parent.done() && joins == 1);
+    assert(done == 2 && group.size() == 0);
+}
+
+task<> join_three_times(task_group& group, gate& g, int& done, int& joins) {
+    group.spawn(quick(done));
+    co_await group.join();
+    ++joins;
+    group.spawn(parked(g, done));
+    co_await group.join();
+    ++joins;
+    group.spawn(quick(done));
+    group.spawn(quick(done));
+    co_await group.join();
+    ++joins;
+}
+
+// a joined group can be spawned into and joined again, either way around
+void test_reuse_after_join() {
+    task_group group;
+    gate g;
+    int done = 0, joins = 0;
+    auto parent = join_three_times(group, g, done, joins);
+    parent.resume();
+    assert(joins == 1 && !parent.done());
+    g.open();
+    assert(parent.done() && joins == 3 && done == 4);
+}
+
+task<> join_parked(task_group& group, gate& a, gate& b, int& done, int& joins) {
+    group.spawn(parked(a, done));
+    group.spawn(quick(done));
+    group.spawn(parked(b, done));
+    co_await group.join();
+    ++joins;
+}
+
+// the last child to finish resumes a suspended join, exactly once
+void test_join_suspends_until_last_child() {
+    task_group group;
+    gate a, b;
+    int done = 0, joins = 0;
+    auto parent = join_parked(group, a, b, done, joins);
+    parent.resume();
+    assert(!parent.done());
+    b.open();
+    assert(!parent.done());
+    a.open();
+    assert(parent.done() && joins == 1 && done == 3);
+}
+
+task<> join_racing(task_group& group, gate& g, int& done,
+    std::atomic<bool>& armed, std::atomic<bool>& joined) {
+    group.spawn(parked(g, done));
+    armed = true;
+    co_await group.join();
+    joined = true;
+}
+
+// the last child finishing on another thread races with join() suspending
+void test_join_races_last_child() {
+    for (int round=0; round<2000; ++round) {
+        task_group group;
+        gate g;
+        int done = 0;
+        std::atomic<bool> armed{false}, joined{false};
+        std::thread finisher([&] {
+            while (!armed) std::this_thread::yield();
+            g.open();
+        });
+        auto parent = join_racing(group, g, done, armed, joined);
+        parent.resume();
+        finisher.join();
+        // join() resumed on the finisher thread, or didn't suspend at all
+        assert(joined && parent.done() && done == 1);
+    }
+}
+
+task<> join_failed(task_group& group, int& done, bool& caught) {
+    group.spawn(failing());
+    group.spawn(quick(done));
+    try {
+        co_await group.join();
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    group.spawn(quick(done));
+    co_await group.join();
+}
+
+// join() rethrows the first failure, and the group stays usable
+void test_failure_rethrown() {
+    task_group group;
+    int done = 0;
+    bool caught = false;
+    auto parent = join_failed(group, done, caught);
+    parent.resume();
+    assert(parent.done() && caught && done == 2);
+    assert(group.token().stop_requested());
+}
+
+int main() {
+    test_synchronous_children();
+    test_reuse_after_join();
+    test_join_suspends_until_last_child();
+    test_join_races_last_child();
+    test_failure_rethrown();
+    std::cout << "test_task_group passed" << std::endl;
+    return 0;
+}
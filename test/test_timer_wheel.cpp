@@ -0,0 +1,102 @@
+#undef NDEBUG
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "timer_wheel.hpp"
+
+using namespace sheep;
+
+struct probe : timer_node
+{
+    timer_wheel* wheel{nullptr};
+    uint64_t fired_at{0};
+    int fired{0};
+
+    explicit probe(timer_wheel& w) noexcept : wheel(&w) { on_expire = &probe::fire; }
+
+    static void fire(timer_node* node) noexcept {
+        auto self = static_cast<probe*>(node);
+        self->fired_at = self->wheel->now();
+        ++self->fired;
+    }
+};
+
+// timers on every level fire on their exact tick, after cascading down
+void test_cascade_across_levels() {
+    timer_wheel wheel;
+    std::vector<uint64_t> expiries{1, 255, 256, 257, 300, 65535, 65536, 65536 + 5,
+        (uint64_t{1} << 24) - 1, (uint64_t{1} << 24) + 7, (uint64_t{1} << 31) + 3};
+    std::vector<probe> probes;
+    probes.reserve(expiries.size());
+    for (auto e: expiries) {
+        probes.emplace_back(wheel);
+        wheel.arm(probes.back(), e);
+    }
+    assert(wheel.size() == expiries.size());
+
+    // in uneven jumps, so cascades happen in the middle of an advance
+    uint64_t now = 0;
+    while (!wheel.empty()) {
+        auto next = wheel.next_event();
+        assert(next > now);
+        now += 997;
+        wheel.advance(now);
+    }
+    for (std::size_t i=0; i<probes.size(); ++i) {
+        assert(probes[i].fired == 1);
+        assert(probes[i].fired_at == expiries[i]);
+    }
+}
+
+// next_event() never lies past the earliest expiry
+void test_next_event_not_late() {
+    timer_wheel wheel{1000};
+    probe a{wheel}, b{wheel};
+    wheel.arm(a, 1000 + 70000);
+    wheel.arm(b, 1000 + 300);
+    assert(wheel.next_event() <= 1300);
+    wheel.advance(1300);
+    assert(b.fired == 1 && b.fired_at == 1300);
+    assert(wheel.next_event() <= 71000);
+    wheel.advance(71000);
+    assert(a.fired == 1 && a.fired_at == 71000);
+    assert(wheel.next_event() == 0);
+}
+
+// re-arming moves a timer, cancelling removes it from any level
+void test_rearm_and_cancel() {
+    timer_wheel wheel;
+    probe a{wheel}, b{wheel}, c{wheel};
+    wheel.arm(a, 100000);
+    wheel.arm(a, 50);
+    wheel.arm(b, 70000);
+    wheel.arm(c, 20);
+    wheel.cancel(b);
+    wheel.cancel(b);
+    assert(wheel.size() == 2);
+    wheel.advance(200000);
+    assert(a.fired == 1 && a.fired_at == 50);
+    assert(b.fired == 0 && !b.armed());
+    assert(c.fired == 1 && c.fired_at == 20);
+    assert(wheel.empty());
+}
+
+// an expiry in the past fires on the next tick
+void test_past_expiry() {
+    timer_wheel wheel{500};
+    probe a{wheel};
+    wheel.arm(a, 10);
+    wheel.advance(501);
+    assert(a.fired == 1 && a.fired_at == 501);
+}
+
+int main() {
+    test_cascade_across_levels();
+    test_next_event_not_late();
+    test_rearm_and_cancel();
+    test_past_expiry();
+    std::cout << "test_timer_wheel passed" << std::endl;
+    return 0;
+}
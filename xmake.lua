@@ -40,6 +40,29 @@ target("sheep")
 --     add_deps("sheep")
 
 
+target("test_timer_wheel")
+    set_kind("binary")
+    add_includedirs("include")
+    add_files("test/test_timer_wheel.cpp")
+
+target("test_chained_buffer")
+    set_kind("binary")
+    add_includedirs("include")
+    add_files("test/test_chained_buffer.cpp")
+    add_syslinks("pthread")
+
+target("test_slab_pool")
+    set_kind("binary")
+    add_includedirs("include")
+    add_files("test/test_slab_pool.cpp")
+    add_syslinks("pthread")
+
+target("test_task_group")
+    set_kind("binary")
+    add_includedirs("include")
+    add_files("test/test_task_group.cpp")
+    add_syslinks("pthread")
+
 target("echo_server")
     set_kind("binary")
     add_includedirs("include")